@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_BENCHES 16
+#define MIN_REP_SECONDS 0.05 // each repetition loops over the tree until it has run this long
+#define CONTENT_MAX_BYTES (256LL * 1024 * 1024) // file contents held in memory, overridden by -m
+#define ARCHIVE_CHUNK_SIZE (256 * 1024) // the archive writer's deflate buffer and send size
+#define ARCHIVE_LEVEL 6 // gzip level used for compressible members
+#define BENCH_FORMAT 2 // bumped when the result lines change meaning
+
+// Micro-benchmarks for the stages a node spends a command in, each timed on
+// its own over a tree from fixturew24: walking directories, stat-ing files,
+// running the find commands of w24ft and w24fda, writing tar headers,
+// deflating member by member, and sending over loopback TCP. Every repetition
+// loops until it has run for a while, and the median of the repetitions is
+// kept. -o writes one JSON line per benchmark, and -c sets two such files side
+// by side, so two builds can be compared on the same tree.
+//
+//   benchw24 <dir> [-r repetitions] [-b bench,...] [-m content MB] [-l label] [-o results.json]
+//   benchw24 -c <old.json> <new.json>
+//
+// benches: walk, stat, ext, date, tarheader, deflate, send, sendfile (default all)
+//
+// tarheader and the choice of stored members run the node's own code: benchw24
+// is linked with serverw24.c, built with -DW24_NO_MAIN (see the README).
+
+// From serverw24.c
+int tarHeader(unsigned char block[512], const char *name, const struct stat *st, char typeflag, const char *linkname);
+int memberIncompressible(const char *path, int fd, off_t size);
+
+typedef struct {
+    char *path;
+    const char *name; // relative to the benchmarked directory
+    struct stat st;
+    int level; // as archiveAddFile picks it: stored when incompressible
+} BenchFile;
+
+typedef struct {
+    const char *name;
+    const char *unit; // what one op is
+    long long (*run)(long long *bytes); // one pass over the tree; returns ops, adds bytes moved
+} Bench;
+
+typedef struct {
+    char bench[32];
+    double median_ns;
+    double mb_per_s;
+} Result;
+
+BenchFile *files;
+size_t file_count;
+size_t file_capacity;
+char root[PATH_MAX];
+size_t root_len;
+unsigned char *content; // contents of the first content_files files, back to back
+long long content_bytes;
+size_t content_files;
+size_t stored_files; // of those, members the nodes would store without compression
+int drain_socket = -1; // loopback connection read to the end by a child
+volatile long long sink; // keeps results the compiler could otherwise drop
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int addFile(const char *path, const struct stat *st) {
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity ? file_capacity * 2 : 1024;
+        BenchFile *grown = realloc(files, file_capacity * sizeof(BenchFile));
+        if (grown == NULL) {
+            return -1;
+        }
+        files = grown;
+    }
+    BenchFile *file = &files[file_count];
+    file->path = strdup(path);
+    if (file->path == NULL) {
+        return -1;
+    }
+    file->name = file->path + root_len + 1;
+    file->st = *st;
+    file_count++;
+    return 0;
+}
+
+// Walks the tree with opendir/readdir, as the nodes' listings do; collect
+// also records every regular file for the other benchmarks
+long long walkTree(const char *dir, int collect) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    long long entries = 0;
+    struct dirent *entry;
+    char path[PATH_MAX];
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        entries++;
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        if (entry->d_type == DT_DIR) {
+            entries += walkTree(path, collect);
+        } else if (collect && entry->d_type == DT_REG) {
+            struct stat st;
+            if (lstat(path, &st) == 0) {
+                addFile(path, &st);
+            }
+        }
+    }
+    closedir(d);
+    return entries;
+}
+
+long long benchWalk(long long *bytes) {
+    (void)bytes;
+    return walkTree(root, 0);
+}
+
+long long benchStat(long long *bytes) {
+    (void)bytes;
+    struct stat st;
+    for (size_t i = 0; i < file_count; i++) {
+        if (lstat(files[i].path, &st) == 0) {
+            sink += st.st_size;
+        }
+    }
+    return file_count;
+}
+
+// Runs a find command as fileListCollectFind does and counts the paths it prints
+long long runFind(const char *find_cmd) {
+    FILE *find_output = popen(find_cmd, "r");
+    if (find_output == NULL) {
+        return -1;
+    }
+    char path[PATH_MAX];
+    long long matches = 0;
+    while (fgets(path, sizeof(path), find_output) != NULL) {
+        matches++;
+    }
+    pclose(find_output);
+    return matches;
+}
+
+// The find command of "w24ft txt c pdf"
+long long benchExt(long long *bytes) {
+    (void)bytes;
+    char find_cmd[PATH_MAX + 128];
+    snprintf(find_cmd, sizeof(find_cmd), "find \"%s\" -type f \\( -name \"*.txt\" -o -name \"*.c\" -o -name \"*.pdf\" \\)",
+             root);
+    long long matches = runFind(find_cmd);
+    if (matches < 0) {
+        return 0;
+    }
+    sink += matches;
+    return file_count;
+}
+
+// The find command of "w24fda 2024-01-01"
+long long benchDate(long long *bytes) {
+    (void)bytes;
+    char find_cmd[PATH_MAX + 64];
+    snprintf(find_cmd, sizeof(find_cmd), "find \"%s\" -type f -newermt \"2024-01-01\"", root);
+    long long matches = runFind(find_cmd);
+    if (matches < 0) {
+        return 0;
+    }
+    sink += matches;
+    return file_count;
+}
+
+long long benchTarHeader(long long *bytes) {
+    unsigned char block[512];
+    for (size_t i = 0; i < file_count; i++) {
+        tarHeader(block, files[i].name, &files[i].st, '0', NULL);
+        sink += block[148];
+    }
+    *bytes += file_count * 512LL;
+    return file_count;
+}
+
+// Feeds len bytes into the current member in archive-writer sized output pieces
+void deflateAll(z_stream *zs, unsigned char *out, const unsigned char *data, size_t len, int flush) {
+    zs->next_in = (unsigned char *)data;
+    zs->avail_in = len;
+    int ret;
+    do {
+        zs->next_out = out;
+        zs->avail_out = ARCHIVE_CHUNK_SIZE;
+        ret = deflate(zs, flush);
+    } while (ret != Z_STREAM_ERROR && (zs->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END)));
+}
+
+// One gzip member per file, as archiveAddFile writes them: the stream is reset
+// to the file's level, then gets the tar header, the data in archive-writer
+// sized pieces and the padding, and is finished
+long long benchDeflate(long long *bytes) {
+    static unsigned char out[ARCHIVE_CHUNK_SIZE];
+    static const unsigned char padding[512];
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, ARCHIVE_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    const unsigned char *data = content;
+    for (size_t i = 0; i < content_files; i++) {
+        const BenchFile *file = &files[i];
+        unsigned char header[512];
+        if (deflateReset(&zs) != Z_OK || deflateParams(&zs, file->level, Z_DEFAULT_STRATEGY) != Z_OK) {
+            break;
+        }
+        tarHeader(header, file->name, &file->st, '0', NULL);
+        deflateAll(&zs, out, header, sizeof(header), Z_NO_FLUSH);
+        for (off_t offset = 0; offset < file->st.st_size; offset += ARCHIVE_CHUNK_SIZE) {
+            off_t left = file->st.st_size - offset;
+            deflateAll(&zs, out, data + offset, left < ARCHIVE_CHUNK_SIZE ? (size_t)left : ARCHIVE_CHUNK_SIZE,
+                       Z_NO_FLUSH);
+        }
+        deflateAll(&zs, out, padding, (512 - file->st.st_size % 512) % 512, Z_FINISH);
+        sink += zs.total_out;
+        data += file->st.st_size;
+    }
+    deflateEnd(&zs);
+    *bytes += content_bytes;
+    return content_files;
+}
+
+long long benchSend(long long *bytes) {
+    for (long long offset = 0; offset < content_bytes;) {
+        long long len = content_bytes - offset < ARCHIVE_CHUNK_SIZE ? content_bytes - offset : ARCHIVE_CHUNK_SIZE;
+        ssize_t n = send(drain_socket, content + offset, len, 0);
+        if (n <= 0) {
+            return 0;
+        }
+        offset += n;
+    }
+    *bytes += content_bytes;
+    return content_files;
+}
+
+// The kernel copy send_archive uses, from the page cache to the socket
+long long benchSendfile(long long *bytes) {
+    for (size_t i = 0; i < content_files; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        off_t offset = 0;
+        while (offset < files[i].st.st_size && sendfile(drain_socket, fd, &offset, files[i].st.st_size - offset) > 0) {
+        }
+        *bytes += offset;
+        close(fd);
+    }
+    return content_files;
+}
+
+Bench benches[] = {
+    {"walk", "entry", benchWalk},
+    {"stat", "file", benchStat},
+    {"ext", "file", benchExt},
+    {"date", "file", benchDate},
+    {"tarheader", "file", benchTarHeader},
+    {"deflate", "file", benchDeflate},
+    {"send", "file", benchSend},
+    {"sendfile", "file", benchSendfile},
+};
+#define BENCH_COUNT (int)(sizeof(benches) / sizeof(benches[0]))
+
+// Loads file contents, in walk order, up to max_bytes
+int loadContent(long long max_bytes) {
+    long long total = 0;
+    while (content_files < file_count && total + files[content_files].st.st_size <= max_bytes) {
+        total += files[content_files++].st.st_size;
+    }
+    content = malloc(total + 1);
+    if (content == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < content_files; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        ssize_t n = 0;
+        long long len = 0;
+        while (fd != -1 && len < files[i].st.st_size && (n = read(fd, content + content_bytes + len, files[i].st.st_size - len)) > 0) {
+            len += n;
+        }
+        // The node's own decision, including the entropy sample under W24_ENTROPY_SAMPLE
+        files[i].level = fd != -1 && memberIncompressible(files[i].name, fd, files[i].st.st_size) ? Z_NO_COMPRESSION
+                                                                                                 : ARCHIVE_LEVEL;
+        stored_files += files[i].level == Z_NO_COMPRESSION;
+        if (fd != -1) {
+            close(fd);
+        }
+        // A file that shrank is padded with zeros, as archiveAddFile does
+        memset(content + content_bytes + len, 0, files[i].st.st_size - len);
+        content_bytes += files[i].st.st_size;
+    }
+    return 0;
+}
+
+// Connects drain_socket over loopback TCP to a child that discards everything
+int startDrain(void) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addr_len) == -1) {
+        perror("drain listener");
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = accept(listener, NULL, NULL);
+        static char buffer[ARCHIVE_CHUNK_SIZE];
+        while (fd != -1 && read(fd, buffer, sizeof(buffer)) > 0) {
+        }
+        _exit(0);
+    }
+    close(listener);
+    drain_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (pid == -1 || drain_socket == -1 || connect(drain_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("drain connection");
+        return -1;
+    }
+    return 0;
+}
+
+int doubleCompare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Times one benchmark and prints its table row and, if out is open, its result line
+void runBench(const Bench *bench, int reps, FILE *out) {
+    // An untimed pass warms caches and sizes the loop
+    long long bytes = 0;
+    double start = now();
+    long long ops = bench->run(&bytes);
+    double once = now() - start;
+    if (ops <= 0) {
+        printf("%-10s %12s\n", bench->name, "skipped");
+        return;
+    }
+    long long iterations = once > 0 ? (long long)(MIN_REP_SECONDS / once) + 1 : 1;
+    double *ns = malloc(reps * sizeof(double));
+    double *rates = malloc(reps * sizeof(double));
+    if (ns == NULL || rates == NULL) {
+        free(ns);
+        free(rates);
+        return;
+    }
+    for (int r = 0; r < reps; r++) {
+        bytes = 0;
+        start = now();
+        for (long long i = 0; i < iterations; i++) {
+            bench->run(&bytes);
+        }
+        double seconds = now() - start;
+        ns[r] = seconds * 1e9 / (ops * iterations);
+        rates[r] = seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+    }
+    qsort(ns, reps, sizeof(double), doubleCompare);
+    qsort(rates, reps, sizeof(double), doubleCompare);
+    double median = reps % 2 ? ns[reps / 2] : (ns[reps / 2 - 1] + ns[reps / 2]) / 2;
+    double rate = reps % 2 ? rates[reps / 2] : (rates[reps / 2 - 1] + rates[reps / 2]) / 2;
+    printf("%-10s %12lld %10lld %12.1f %12.1f %12.1f", bench->name, ops, iterations, ns[0], median, ns[reps - 1]);
+    if (bytes > 0) {
+        printf(" %10.1f", rate);
+    }
+    printf("\n");
+    if (out != NULL) {
+        fprintf(out,
+                "{\"bench\":\"%s\",\"unit\":\"%s\",\"ops\":%lld,\"iterations\":%lld,\"reps\":%d,"
+                "\"ns_per_op_min\":%.1f,\"ns_per_op_median\":%.1f,\"ns_per_op_max\":%.1f,\"mb_per_s\":%.1f}\n",
+                bench->name, bench->unit, ops, iterations, reps, ns[0], median, ns[reps - 1], bytes > 0 ? rate : 0.0);
+    }
+    free(ns);
+    free(rates);
+}
+
+// Reads the result lines of a -o file
+int loadResults(const char *path, Result *results, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    char line[1024];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), f) != NULL) {
+        const char *bench = strstr(line, "\"bench\":\"");
+        const char *median = strstr(line, "\"ns_per_op_median\":");
+        const char *rate = strstr(line, "\"mb_per_s\":");
+        if (bench == NULL || median == NULL) {
+            continue;
+        }
+        Result *r = &results[count++];
+        snprintf(r->bench, sizeof(r->bench), "%.*s", (int)strcspn(bench + 9, "\""), bench + 9);
+        r->median_ns = atof(median + 19);
+        r->mb_per_s = rate != NULL ? atof(rate + 11) : 0;
+    }
+    fclose(f);
+    return count;
+}
+
+// Prints two result files side by side; negative changes are speedups
+int compareResults(const char *old_path, const char *new_path) {
+    Result old_results[MAX_BENCHES], new_results[MAX_BENCHES];
+    int old_count = loadResults(old_path, old_results, MAX_BENCHES);
+    int new_count = loadResults(new_path, new_results, MAX_BENCHES);
+    if (old_count < 0 || new_count < 0) {
+        return 1;
+    }
+    printf("%-10s %14s %14s %9s\n", "bench", "old ns/op", "new ns/op", "change");
+    for (int i = 0; i < new_count; i++) {
+        const Result *now_r = &new_results[i], *was = NULL;
+        for (int j = 0; j < old_count && was == NULL; j++) {
+            if (strcmp(old_results[j].bench, now_r->bench) == 0) {
+                was = &old_results[j];
+            }
+        }
+        if (was == NULL || was->median_ns <= 0) {
+            printf("%-10s %14s %14.1f\n", now_r->bench, "-", now_r->median_ns);
+            continue;
+        }
+        printf("%-10s %14.1f %14.1f %+8.1f%%\n", now_r->bench, was->median_ns, now_r->median_ns,
+               100.0 * (now_r->median_ns - was->median_ns) / was->median_ns);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 4 && strcmp(argv[1], "-c") == 0) {
+        return compareResults(argv[2], argv[3]);
+    }
+    int reps = 5;
+    long long content_max = CONTENT_MAX_BYTES;
+    const char *selected = NULL, *label = "", *out_path = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:b:m:l:o:")) != -1) {
+        switch (opt) {
+            case 'r':
+                reps = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'b':
+                selected = optarg;
+                break;
+            case 'm':
+                content_max = atoll(optarg) * 1024 * 1024;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'o':
+                out_path = optarg;
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s <dir> [-r repetitions] [-b bench,...] [-m content MB] [-l label] [-o results.json]\n"
+                        "       %s -c <old.json> <new.json>\n",
+                        argv[0], argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || realpath(argv[optind], root) == NULL) {
+        fprintf(stderr, "Usage: %s <dir> [-r repetitions] [-b bench,...] [-m content MB] [-l label] [-o results.json]\n",
+                argv[0]);
+        return 1;
+    }
+    root_len = strlen(root);
+    signal(SIGPIPE, SIG_IGN);
+    walkTree(root, 1);
+    if (file_count == 0) {
+        fprintf(stderr, "No files under %s\n", root);
+        return 1;
+    }
+    long long total_bytes = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        total_bytes += files[i].st.st_size;
+    }
+    if (loadContent(content_max) == -1 || startDrain() == -1) {
+        return 1;
+    }
+    FILE *out = NULL;
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        perror(out_path);
+        return 1;
+    }
+    if (out != NULL) {
+        fprintf(out,
+                "{\"benchw24\":%d,\"label\":\"%s\",\"tree\":\"%s\",\"files\":%zu,\"bytes\":%lld,\"content_bytes\":%lld,"
+                "\"stored_files\":%zu}\n",
+                BENCH_FORMAT, label, root, file_count, total_bytes, content_bytes, stored_files);
+    }
+    printf("%zu files, %lld bytes under %s; %zu files (%lld bytes, %zu stored) in memory for deflate/send\n\n",
+           file_count, total_bytes, root, content_files, content_bytes, stored_files);
+    printf("%-10s %12s %10s %12s %12s %12s %10s\n", "bench", "ops/pass", "passes", "min ns/op", "median", "max",
+           "MB/s");
+    for (int b = 0; b < BENCH_COUNT; b++) {
+        if (selected != NULL) {
+            // Whole names only, so "send" does not pick up "sendfile"
+            const char *p = selected;
+            size_t len = strlen(benches[b].name);
+            while ((p = strstr(p, benches[b].name)) != NULL &&
+                   !((p == selected || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))) {
+                p += len;
+            }
+            if (p == NULL) {
+                continue;
+            }
+        }
+        runBench(&benches[b], reps, out);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    close(drain_socket);
+    wait(NULL);
+    return 0;
+}
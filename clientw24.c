@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,49 +6,342 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <time.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <math.h>
+#include <ftw.h>
+#include <limits.h>
+#include <errno.h>
+#include <zlib.h>
  
 #define SERVER_IP "127.0.0.1" // localhost
 #define PORT 8888
+#define MIRROR1_PORT 8889
+#define MIRROR2_PORT 8890
 #define MAXDATASIZE 1024
  #define BUFFER_SIZE 1024
+#define RECV_BUFFER_SIZE (256 * 1024) // socket read buffer for replies
+#define WRITE_BUFFER_SIZE (1024 * 1024) // archive bytes are written to disk in blocks of this size
+#define RESUME_FILE "temp.tar.gz.resume" // "<id> <total>" of a download that has not completed
+#define RESUME_ATTEMPTS 3 // reconnects tried when a download is cut off
+#define STRIPE_NODES 3 // with W24_STRIPE set, archives are fetched from this many nodes at once
+#define SYNC_DIR "w24sync" // default local copy kept up to date by w24sync, overridden by W24_SYNC_DIR
+#define SYNC_MIN_BLOCK 1024 // bounds of the per-file checksum block size
+#define SYNC_MAX_BLOCK (128 * 1024)
+#define BATCH_WINDOW 16 // commands in flight at once in batch mode
+#define META_DIR "w24meta" // cached dirlist/w24fn replies, overridden by W24_META_DIR ("" turns caching off)
 
  
-// Function to send commands to the server and receive responses
-void sendRequest(int client_socket, const char *command) {
-    char buffer[MAXDATASIZE];
-    int num_bytes_recv;
- 
-    // Send command to server
-    printf("Sending command to server: %s\n", command); // Debug statement
-    if (send(client_socket, command, strlen(command), 0) == -1) {
-        perror("Send failed");
+// Buffered reader over the server socket, so reply headers and bodies can
+// be parsed without a recv() per byte
+typedef struct {
+    int fd;
+    char buf[RECV_BUFFER_SIZE];
+    size_t start;
+    size_t end;
+} Reader;
+
+Reader reader;
+
+// Batch mode prints one JSON line per command instead of progress messages
+int batch_mode = 0;
+
+// Progress messages for interactive use
+void note(const char *fmt, ...) {
+    if (batch_mode) {
         return;
     }
- 
-    if (strcmp(command, "quitc") == 0) {
-        return; // No need to receive response for quit command
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+// What the last reply was, for the batch result lines
+typedef struct {
+    const char *type; // "text", "archive" or "delta"
+    long long bytes;
+    int ok;
+    char id[64];
+    char *text;
+    int cached; // the node confirmed the cached copy is current
+} Reply;
+
+Reply last_reply;
+
+void replyReset(void) {
+    free(last_reply.text);
+    memset(&last_reply, 0, sizeof(last_reply));
+}
+
+// Reads one header line into line (without the '\n'); returns -1 on disconnect
+int readLine(Reader *r, char *line, size_t size) {
+    size_t len = 0;
+    while (1) {
+        while (r->start < r->end) {
+            char c = r->buf[r->start++];
+            if (c == '\n') {
+                line[len] = '\0';
+                return 0;
+            }
+            if (len + 1 < size) {
+                line[len++] = c;
+            }
+        }
+        ssize_t n = recv(r->fd, r->buf, sizeof(r->buf), 0);
+        if (n <= 0) {
+            return -1;
+        }
+        r->start = 0;
+        r->end = n;
+    }
+}
+
+// Reads up to size bytes, serving buffered data first; returns 0 on disconnect
+ssize_t readSome(Reader *r, char *dst, size_t size) {
+    if (r->start < r->end) {
+        size_t n = r->end - r->start < size ? r->end - r->start : size;
+        memcpy(dst, r->buf + r->start, n);
+        r->start += n;
+        return n;
     }
+    return recv(r->fd, dst, size, 0);
+}
+
+// Receives exactly size bytes into dst
+int readExact(Reader *r, char *dst, size_t size) {
+    while (size > 0) {
+        ssize_t n = readSome(r, dst, size);
+        if (n <= 0) {
+            return -1;
+        }
+        dst += n;
+        size -= n;
+    }
+    return 0;
+}
+
+double elapsedSeconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void getTarfile(Reader *r, const char *header);
+void getTarfileChunked(Reader *r);
+int makeConnection();
+void makeParents(const char *path);
+char *metaLoad(const char *command, char tag[17], long long *length, const char **type);
+void metaStore(const char *command, const char *tag, const char *type, const char *text, long long length);
+
+// Copies the value of a "name=value" field of a reply header; returns -1 if absent
+int headerField(const char *header, const char *name, char *value, size_t size) {
+    size_t len = strlen(name);
+    for (const char *p = strchr(header, ' '); p != NULL; p = strchr(p + 1, ' ')) {
+        if (strncmp(p + 1, name, len) == 0 && p[1 + len] == '=') {
+            snprintf(value, size, "%.*s", (int)strcspn(p + 2 + len, " "), p + 2 + len);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+long long headerNumber(const char *header, const char *name, long long missing) {
+    char value[32];
+    return headerField(header, name, value, sizeof(value)) == 0 ? atoll(value) : missing;
+}
+
+// Receives and prints the body of a "TEXT <length>" reply
+void receiveText(Reader *r, const char *header) {
+    long long length = strncmp(header, "TEXT ", 5) == 0 ? atoll(header + 5) : 0;
+    char *buffer = malloc(length + 1);
+    if (buffer == NULL || readExact(r, buffer, length) == -1) {
+        note("Receive failed");
+        free(buffer);
+        return;
+    }
+    buffer[length] = '\0';
+    note("Received %lld bytes from server: %s\n", length, buffer); // Debug statement
  
-    // Receive response from server
-    num_bytes_recv = recv(client_socket, buffer, MAXDATASIZE, 0);
-    if (num_bytes_recv == -1) {
-        printf("Receive failed");
+    // Print received data
+    note("Received data from server: %s\n", buffer);
+    last_reply.type = "text";
+    last_reply.bytes = length;
+    last_reply.ok = 1;
+    last_reply.text = buffer;
+}
+
+unsigned long long getLittle(const unsigned char *p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+// A "w24fq ... list" query is answered with a listing rather than an archive
+int isListQuery(const char *command) {
+    size_t len = strlen(command);
+    return strncmp(command, "w24fq ", 6) == 0 && (strstr(command, " list ") != NULL ||
+                                                  (len >= 5 && strcmp(command + len - 5, " list") == 0));
+}
+
+// With W24_BINARY set, dirlist, w24fn and w24fq listings are sent as
+// "w24bin <command>" and answered with binary records instead of text
+int wantRecords(const char *command) {
+    const char *binary = getenv("W24_BINARY");
+    return binary != NULL && binary[0] != '\0' && strcmp(binary, "0") != 0 &&
+           (strcmp(command, "dirlist -a") == 0 || strcmp(command, "dirlist -t") == 0 ||
+            strncmp(command, "w24fn ", 6) == 0 || isListQuery(command));
+}
+
+// Receives a "RECORDS <length>" reply and prints it as the text the node would
+// have sent, so output and the reply cache look the same either way. Each
+// record is name length (u16), name, size (u64), mtime and ctime (i64), mode
+// (u32), little-endian.
+void receiveRecords(Reader *r, const char *header, const char *command) {
+    long long length = atoll(header + 8);
+    unsigned char *body = malloc(length + 1);
+    if (body == NULL || readExact(r, (char *)body, length) == -1) {
+        note("Receive failed");
+        free(body);
         return;
-    } else if (num_bytes_recv == 0) {
-        printf("Server closed the connection\n");
+    }
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    long long offset = 0;
+    int count = 0;
+    while (out != NULL && offset + 2 <= length) {
+        size_t name_len = getLittle(body + offset, 2);
+        const unsigned char *p = body + offset + 2 + name_len;
+        if (offset + 2 + (long long)name_len + 28 > length) {
+            break;
+        }
+        long long size = getLittle(p, 8);
+        time_t ctime = (time_t)getLittle(p + 16, 8);
+        unsigned int mode = getLittle(p + 24, 4);
+        if (strncmp(command, "w24fn ", 6) == 0) {
+            char created_time[20];
+            strftime(created_time, sizeof(created_time), "%Y-%m-%d %H:%M:%S", localtime(&ctime));
+            fprintf(out, "%.*s Size: %lld bytes, Created: %s, Permissions: %o", (int)name_len,
+                    (const char *)body + offset + 2, size, created_time, mode);
+        } else {
+            fprintf(out, "%.*s\n", (int)name_len, (const char *)body + offset + 2);
+        }
+        offset += 2 + name_len + 28;
+        count++;
+    }
+    if (out != NULL && count == 0 && strncmp(command, "w24fn ", 6) == 0) {
+        fprintf(out, "File not found\n");
+    }
+    free(body);
+    if (out == NULL || fclose(out) != 0 || offset != length) {
+        note("Malformed records reply\n");
+        free(text);
         return;
+    }
+    note("Received %d records (%lld bytes) from server\n", count, length);
+    note("Received data from server: %s\n", text);
+    last_reply.type = "records";
+    last_reply.bytes = length;
+    last_reply.ok = 1;
+    last_reply.text = text;
+}
+
+// Id of the last command sent, when W24_TRACE is set
+char sent_rid[48];
+
+// Sends one command. The '\n' ends it, so the server can tell pipelined commands apart.
+// A command whose reply is cached is sent as "w24if <etag> <command>", and with
+// W24_BINARY set dirlist and w24fn go as "w24bin <command>". With
+// W24_TRACE set, each command is also given a request id, "<pid>.<n>", sent
+// in front as "w24rid <id> ", which the nodes put on its trace spans.
+int sendCommand(int client_socket, const char *command) {
+    static unsigned int sequence;
+    char line[MAXDATASIZE + 128], tag[17], prefix[64] = "";
+    const char *trace = getenv("W24_TRACE");
+    sent_rid[0] = '\0';
+    if (trace != NULL && trace[0] != '\0') {
+        snprintf(sent_rid, sizeof(sent_rid), "%d.%u", getpid(), ++sequence);
+        snprintf(prefix, sizeof(prefix), "w24rid %s ", sent_rid);
+    }
+    const char *binary = wantRecords(command) ? "w24bin " : "";
+    char *cached = metaLoad(command, tag, NULL, NULL);
+    int len = cached != NULL ? snprintf(line, sizeof(line), "%sw24if %s %s%s\n", prefix, tag, binary, command)
+                             : snprintf(line, sizeof(line), "%s%s%s\n", prefix, binary, command);
+    free(cached);
+    if (send(client_socket, line, len, 0) != len) {
+        perror("Send failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Receives and handles the reply to command; returns -1 if the connection closed first
+int receiveReply(Reader *r, const char *command) {
+    char header[256], tag[17];
+ 
+    // Every reply starts with a "<TEXT|RECORDS|ARCHIVE> <length|chunked>" header line
+    if (readLine(r, header, sizeof(header)) == -1) {
+        note("Server closed the connection\n");
+        return -1;
+    }
+    if (strncmp(header, "UNCHANGED", 9) == 0) {
+        // Answer to "w24if": the cached copy is still current
+        char *text = metaLoad(command, tag, &last_reply.bytes, &last_reply.type);
+        last_reply.ok = text != NULL;
+        last_reply.cached = 1;
+        last_reply.text = text;
+        note("Received data from server (unchanged since cached): %s\n", text != NULL ? text : "");
+        return 0;
+    }
+    if (strncmp(header, "ARCHIVE ", 8) == 0) {
+        if (strcmp(header + 8, "chunked") == 0) {
+            getTarfileChunked(r);
+        } else {
+            getTarfile(r, header);
+        }
+        return 0;
+    }
+    if (strncmp(header, "RECORDS ", 8) == 0) {
+        receiveRecords(r, header, command);
     } else {
-        buffer[num_bytes_recv] = '\0';
-        printf("Received %d bytes from server: %s\n", num_bytes_recv, buffer); // Debug statement
+        receiveText(r, header);
+    }
+    if (last_reply.ok && headerField(header, "etag", tag, sizeof(tag)) == 0) {
+        metaStore(command, tag, last_reply.type, last_reply.text, strlen(last_reply.text));
+    }
+    return 0;
+}
+
+// Function to send commands to the server and receive responses
+void sendRequest(int client_socket, const char *command) {
+    // Send command to server
+    note("Sending command to server: %s\n", command); // Debug statement
+    replyReset();
+    if (sendCommand(client_socket, command) == -1) {
+        return;
+    }
+    if (sent_rid[0] != '\0') {
+        note("Request id: %s\n", sent_rid);
+    }
  
-        // Print received data
-        printf("Received data from server: %s\n", buffer);
+    if (strcmp(command, "quitc") == 0) {
+        return; // No need to receive response for quit command
     }
+    receiveReply(&reader, command);
 }
 
-// Function to establish connection to the server
-int makeConnection() {
+// Function to establish connection to a node
+int connectTo(const char *ip, int port) {
     int client_socket;
     struct sockaddr_in server_addr;
 
@@ -59,12 +353,12 @@ int makeConnection() {
 
     // Server address setup
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = inet_addr(SERVER_IP);
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = inet_addr(ip);
     memset(&(server_addr.sin_zero), '\0', 8);
 
     // Print IP address and port where the code is being sent
-    printf("Sending code to %s:%d\n", SERVER_IP, PORT);
+    note("Sending code to %s:%d\n", ip, port);
 
     // Connect to server
     if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
@@ -72,39 +366,1108 @@ int makeConnection() {
         close(client_socket);
         return -1;
     }
+    // Commands are small and may be pipelined; send each at once rather than waiting on the last one's ACK
+    int nodelay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
 
     return client_socket; // Return the client socket descriptor
 }
 
- // Function to receive and save the tar file from the server
-void getTarfile(int client_socket, long tar_size) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    long total_received = 0;
+// Function to establish connection to the server
+int makeConnection() {
+    return connectTo(SERVER_IP, PORT);
+}
 
-    // Open file for writing
-    FILE *tar_file = fopen("temp.tar.gz", "wb");
-    if (tar_file == NULL) {
-        perror("Error opening tar file for writing");
+// Streaming extraction: with W24_EXTRACT_DIR set, archive bytes are inflated
+// and unpacked into that directory as they arrive instead of being saved as
+// temp.tar.gz. Files are preallocated from their tar header size, written in
+// large blocks, and synced to disk once when the archive is complete.
+enum { EXTRACT_SKIP, EXTRACT_FILE, EXTRACT_LONG_NAME, EXTRACT_LONG_LINK };
+
+typedef struct {
+    z_stream zs;
+    int stream_ended; // the last gzip member is complete; another may follow
+    char dir[PATH_MAX];
+    unsigned char header[512];
+    size_t header_used;
+    long long data_left; // bytes of the current member's data still to come
+    long long pad_left; // zero padding after the data, up to the next 512 byte block
+    int kind;
+    int fd;
+    char path[2 * PATH_MAX];
+    mode_t mode;
+    struct timespec mtime;
+    char long_name[PATH_MAX];
+    char long_link[PATH_MAX];
+    size_t long_used;
+    unsigned char *inflated;
+    unsigned char *block; // file data waiting to be written
+    size_t block_used;
+    int files;
+    long long bytes;
+    int failed;
+} Extractor;
+
+const char *extractDir(void) {
+    const char *dir = getenv("W24_EXTRACT_DIR");
+    return dir != NULL && *dir != '\0' ? dir : NULL;
+}
+
+int extractorOpen(Extractor *ex, const char *dir) {
+    memset(ex, 0, sizeof(*ex));
+    ex->fd = -1;
+    snprintf(ex->dir, sizeof(ex->dir), "%s", dir);
+    mkdir(dir, 0755);
+    ex->inflated = malloc(RECV_BUFFER_SIZE);
+    ex->block = malloc(WRITE_BUFFER_SIZE);
+    // windowBits 15 + 32 accepts the gzip wrapper of each member
+    if (ex->inflated == NULL || ex->block == NULL || inflateInit2(&ex->zs, 15 + 32) != Z_OK) {
+        free(ex->inflated);
+        free(ex->block);
+        fprintf(stderr, "Error initialising extraction\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads a tar number field, octal or GNU base-256
+long long tarField(const unsigned char *field, int width) {
+    long long value = 0;
+    if (field[0] & 0x80) {
+        for (int i = 1; i < width; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    for (int i = 0; i < width && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+// Member names must stay inside the target directory
+int safeMemberName(const char *name) {
+    size_t len = strlen(name);
+    return len > 0 && name[0] != '/' && strcmp(name, "..") != 0 && strncmp(name, "../", 3) != 0 &&
+           strstr(name, "/../") == NULL && (len < 3 || strcmp(name + len - 3, "/..") != 0);
+}
+
+int extractorFlush(Extractor *ex) {
+    size_t done = 0;
+    while (done < ex->block_used) {
+        ssize_t n = write(ex->fd, ex->block + done, ex->block_used - done);
+        if (n == -1) {
+            perror("Error writing extracted file");
+            return -1;
+        }
+        done += n;
+    }
+    ex->block_used = 0;
+    return 0;
+}
+
+void extractorFinishFile(Extractor *ex) {
+    if (ex->fd == -1) {
         return;
     }
+    if (extractorFlush(ex) == -1) {
+        ex->failed = 1;
+    }
+    struct timespec times[2] = {ex->mtime, ex->mtime};
+    fchmod(ex->fd, ex->mode);
+    futimens(ex->fd, times);
+    close(ex->fd);
+    ex->fd = -1;
+    ex->files++;
+}
 
-    // Receive tar file data from server and write it to the file
-    while (total_received < tar_size) {
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received < 0) {
+// Acts on a complete 512 byte header
+void extractorHeader(Extractor *ex) {
+    const unsigned char *h = ex->header;
+    int empty = 1;
+    for (int i = 0; i < 512 && empty; i++) {
+        empty = h[i] == 0;
+    }
+    if (empty) {
+        return; // end-of-archive blocks
+    }
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    }
+    if (sum != tarField(h + 148, 8)) {
+        note("Corrupt tar header in archive stream\n");
+        ex->failed = 1;
+        return;
+    }
+    long long size = tarField(h + 124, 12);
+    char type = h[156];
+    ex->data_left = size;
+    ex->pad_left = (512 - size % 512) % 512;
+    ex->kind = EXTRACT_SKIP;
+    if (type == 'L' || type == 'K') {
+        ex->kind = type == 'L' ? EXTRACT_LONG_NAME : EXTRACT_LONG_LINK;
+        ex->long_used = 0;
+        (type == 'L' ? ex->long_name : ex->long_link)[0] = '\0';
+        return;
+    }
+    char name[PATH_MAX];
+    if (ex->long_name[0] != '\0') {
+        snprintf(name, sizeof(name), "%s", ex->long_name);
+    } else if (h[345] != '\0') {
+        snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+    } else {
+        snprintf(name, sizeof(name), "%.100s", (const char *)h);
+    }
+    char link_name[PATH_MAX];
+    snprintf(link_name, sizeof(link_name), "%s", ex->long_link[0] != '\0' ? ex->long_link : "");
+    if (link_name[0] == '\0') {
+        snprintf(link_name, sizeof(link_name), "%.100s", (const char *)h + 157);
+    }
+    ex->long_name[0] = ex->long_link[0] = '\0';
+    if (!safeMemberName(name)) {
+        note("Skipping unsafe member %s\n", name);
+        return;
+    }
+    snprintf(ex->path, sizeof(ex->path), "%s/%s", ex->dir, name);
+    makeParents(ex->path);
+    if (type == '5') {
+        mkdir(ex->path, 0755);
+    } else if (type == '1' && safeMemberName(link_name)) {
+        char target[2 * PATH_MAX];
+        snprintf(target, sizeof(target), "%s/%s", ex->dir, link_name);
+        unlink(ex->path);
+        if (link(target, ex->path) == -1) {
+            perror("Error linking extracted file");
+        } else {
+            ex->files++;
+        }
+    } else if (type == '0' || type == '\0') {
+        // A symlink left in the target directory must not redirect the write
+        struct stat st;
+        if (lstat(ex->path, &st) == 0 && S_ISLNK(st.st_mode) && unlink(ex->path) == -1) {
+            perror("Error replacing symlink");
+            return;
+        }
+        ex->fd = open(ex->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+        if (ex->fd == -1) {
+            perror("Error creating extracted file");
+            return;
+        }
+        // Reserve the blocks up front so the file is laid out contiguously
+        if (size > 0 && fallocate(ex->fd, 0, 0, size) == -1 && errno != EOPNOTSUPP) {
+            perror("fallocate");
+        }
+        ex->kind = EXTRACT_FILE;
+        ex->mode = tarField(h + 100, 8) & 0777; // no setuid, setgid or sticky bits, as tar does for a non-root user
+        ex->mtime.tv_sec = tarField(h + 136, 12);
+        ex->mtime.tv_nsec = 0;
+        ex->bytes += size;
+        if (size == 0) {
+            extractorFinishFile(ex);
+        }
+    }
+}
+
+// Feeds uncompressed tar bytes through the header/data state machine
+void extractorTar(Extractor *ex, const unsigned char *data, size_t len) {
+    while (len > 0 && !ex->failed) {
+        if (ex->data_left > 0) {
+            size_t n = ex->data_left < (long long)len ? (size_t)ex->data_left : len;
+            if (ex->kind == EXTRACT_FILE) {
+                for (size_t done = 0; done < n;) {
+                    size_t room = WRITE_BUFFER_SIZE - ex->block_used;
+                    size_t take = n - done < room ? n - done : room;
+                    memcpy(ex->block + ex->block_used, data + done, take);
+                    ex->block_used += take;
+                    done += take;
+                    if (ex->block_used == WRITE_BUFFER_SIZE && extractorFlush(ex) == -1) {
+                        ex->failed = 1;
+                        return;
+                    }
+                }
+            } else if (ex->kind == EXTRACT_LONG_NAME || ex->kind == EXTRACT_LONG_LINK) {
+                char *target = ex->kind == EXTRACT_LONG_NAME ? ex->long_name : ex->long_link;
+                size_t take = ex->long_used + n < PATH_MAX - 1 ? n : PATH_MAX - 1 - ex->long_used;
+                memcpy(target + ex->long_used, data, take);
+                ex->long_used += take;
+                target[ex->long_used] = '\0';
+            }
+            ex->data_left -= n;
+            data += n;
+            len -= n;
+            if (ex->data_left == 0 && ex->kind == EXTRACT_FILE) {
+                extractorFinishFile(ex);
+            }
+        } else if (ex->pad_left > 0) {
+            size_t n = ex->pad_left < (long long)len ? (size_t)ex->pad_left : len;
+            ex->pad_left -= n;
+            data += n;
+            len -= n;
+        } else {
+            size_t n = 512 - ex->header_used < len ? 512 - ex->header_used : len;
+            memcpy(ex->header + ex->header_used, data, n);
+            ex->header_used += n;
+            data += n;
+            len -= n;
+            if (ex->header_used == 512) {
+                ex->header_used = 0;
+                extractorHeader(ex);
+            }
+        }
+    }
+}
+
+// Feeds compressed archive bytes; each archive member is its own gzip stream
+int extractorFeed(Extractor *ex, const unsigned char *data, size_t len) {
+    ex->zs.next_in = (unsigned char *)data;
+    ex->zs.avail_in = len;
+    while (ex->zs.avail_in > 0 && !ex->failed) {
+        if (ex->stream_ended) {
+            inflateReset(&ex->zs);
+            ex->stream_ended = 0;
+        }
+        ex->zs.next_out = ex->inflated;
+        ex->zs.avail_out = RECV_BUFFER_SIZE;
+        int ret = inflate(&ex->zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            note("Corrupt archive stream: %s\n", ex->zs.msg != NULL ? ex->zs.msg : "inflate failed");
+            ex->failed = 1;
+            break;
+        }
+        extractorTar(ex, ex->inflated, RECV_BUFFER_SIZE - ex->zs.avail_out);
+        ex->stream_ended = ret == Z_STREAM_END;
+    }
+    return ex->failed ? -1 : 0;
+}
+
+// Finishes extraction with a single sync of the target filesystem
+void extractorClose(Extractor *ex, long long received, const struct timespec *start) {
+    extractorFinishFile(ex);
+    inflateEnd(&ex->zs);
+    free(ex->inflated);
+    free(ex->block);
+    int dir_fd = open(ex->dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        syncfs(dir_fd);
+        close(dir_fd);
+    }
+    double seconds = elapsedSeconds(start);
+    note("Extracted %d files (%lld bytes) into %s from %lld received bytes in %.3f s (%.2f MB/s)%s\n", ex->files,
+           ex->bytes, ex->dir, received, seconds, seconds > 0 ? received / seconds / (1024 * 1024) : 0.0,
+           ex->failed || ex->data_left > 0 ? "; archive incomplete" : "");
+}
+
+// Archive bytes are collected into large blocks before hitting the disk
+typedef struct {
+    int fd;
+    char *block;
+    size_t used;
+    long long total;
+    Extractor *extract; // set when the archive is unpacked rather than saved
+} TarSink;
+
+Extractor extractor;
+
+// Opens temp.tar.gz for bytes starting at offset; a fresh download truncates it.
+// With W24_EXTRACT_DIR set, a whole archive is unpacked there instead.
+int sinkOpen(TarSink *sink, long long offset) {
+    sink->extract = NULL;
+    sink->fd = -1;
+    if (extractDir() != NULL && offset == 0) {
+        if (extractorOpen(&extractor, extractDir()) == -1) {
+            return -1;
+        }
+        sink->extract = &extractor;
+    } else {
+        if (extractDir() != NULL) {
+            note("Cannot unpack part of an archive; saving it to temp.tar.gz\n");
+        }
+        sink->fd = open("temp.tar.gz", O_WRONLY | O_CREAT | (offset == 0 ? O_TRUNC : 0), 0644);
+        if (sink->fd == -1) {
+            perror("Error opening tar file for writing");
+            return -1;
+        }
+        if (lseek(sink->fd, offset, SEEK_SET) == -1) {
+            perror("Error seeking in tar file");
+            close(sink->fd);
+            return -1;
+        }
+    }
+    sink->block = malloc(WRITE_BUFFER_SIZE);
+    sink->used = 0;
+    sink->total = 0;
+    if (sink->block == NULL) {
+        if (sink->fd != -1) {
+            close(sink->fd);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int sinkFlush(TarSink *sink) {
+    if (sink->extract != NULL) {
+        int ret = extractorFeed(sink->extract, (unsigned char *)sink->block, sink->used);
+        sink->used = 0;
+        return ret;
+    }
+    size_t done = 0;
+    while (done < sink->used) {
+        ssize_t n = write(sink->fd, sink->block + done, sink->used - done);
+        if (n == -1) {
+            perror("Error writing tar file");
+            return -1;
+        }
+        done += n;
+    }
+    sink->used = 0;
+    return 0;
+}
+
+// Moves up to count bytes from the socket into the sink; returns bytes moved or -1
+long long sinkReceive(TarSink *sink, Reader *r, long long count) {
+    long long moved = 0;
+    while (moved < count) {
+        if (sink->used == WRITE_BUFFER_SIZE && sinkFlush(sink) == -1) {
+            return -1;
+        }
+        size_t room = WRITE_BUFFER_SIZE - sink->used;
+        ssize_t n = readSome(r, sink->block + sink->used, count - moved < (long long)room ? count - moved : (long long)room);
+        if (n < 0) {
             perror("Error receiving tar file data from server");
+            return -1;
+        } else if (n == 0) {
+            note("Server closed connection.\n");
+            return -1;
+        }
+        sink->used += n;
+        sink->total += n;
+        moved += n;
+    }
+    return moved;
+}
+
+void sinkClose(TarSink *sink, const struct timespec *start) {
+    last_reply.type = "archive";
+    last_reply.bytes = sink->total;
+    last_reply.ok = sinkFlush(sink) == 0;
+    free(sink->block);
+    if (sink->extract != NULL) {
+        last_reply.ok &= !sink->extract->failed && sink->extract->data_left == 0;
+        extractorClose(sink->extract, sink->total, start);
+        return;
+    }
+    close(sink->fd);
+    double seconds = elapsedSeconds(start);
+    note("Received temp.tar.gz: %lld bytes in %.3f s (%.2f MB/s)\n", sink->total, seconds,
+           seconds > 0 ? sink->total / seconds / (1024 * 1024) : 0.0);
+}
+
+// Replaces the reader's connection with a new one carrying bytes offset..end of
+// archive id; returns -1 if the archive cannot be fetched again
+int reopenRange(Reader *r, const char *id, long long offset, long long end) {
+    close(r->fd);
+    r->start = r->end = 0;
+    r->fd = makeConnection();
+    if (r->fd == -1) {
+        return -1;
+    }
+    char request[128];
+    char header[256];
+    snprintf(request, sizeof(request), "w24get %s %lld %lld", id, offset, end - offset);
+    if (sendCommand(r->fd, request) == -1 || readLine(r, header, sizeof(header)) == -1) {
+        return -1;
+    }
+    if (strncmp(header, "ARCHIVE ", 8) != 0 || headerNumber(header, "offset", -1) != offset) {
+        note("Cannot resume %s: %s\n", id, header);
+        return -1;
+    }
+    return 0;
+}
+
+ // Function to receive and save the tar file from the server. If the connection
+ // drops, the rest of the range is fetched again with w24get.
+void getTarfile(Reader *r, const char *header) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char id[64] = "";
+    headerField(header, "id", id, sizeof(id));
+    long long offset = headerNumber(header, "offset", 0);
+    long long end = offset + atoll(header + 8);
+    long long total = headerNumber(header, "total", end);
+    TarSink sink;
+    if (sinkOpen(&sink, offset) == -1) {
+        return;
+    }
+    // Record the download so that a restarted client can finish it; an unpacked
+    // archive cannot be picked up halfway by a new process
+    FILE *resume = id[0] != '\0' && sink.extract == NULL ? fopen(RESUME_FILE, "w") : NULL;
+    if (resume != NULL) {
+        fprintf(resume, "%s %lld\n", id, total);
+        fclose(resume);
+    }
+    int attempts = 0;
+    while (sinkReceive(&sink, r, end - offset - sink.total) == -1) {
+        // Batch mode does not reconnect, as commands pipelined behind this one would be lost
+        if (id[0] == '\0' || batch_mode || attempts++ == RESUME_ATTEMPTS || sinkFlush(&sink) == -1) {
+            break;
+        }
+        sleep(attempts);
+        note("Resuming %s at byte %lld (attempt %d)\n", id, offset + sink.total, attempts);
+        if (reopenRange(r, id, offset + sink.total, end) == -1) {
+            // Leaves a dead socket behind, so the next receive fails straight away
+            continue;
+        }
+    }
+    int extracting = sink.extract != NULL;
+    sinkClose(&sink, &start);
+    snprintf(last_reply.id, sizeof(last_reply.id), "%s", id);
+    last_reply.ok &= offset + sink.total == end;
+    if (offset + sink.total == total) {
+        unlink(RESUME_FILE);
+    } else if (offset + sink.total < end && !extracting) {
+        note("Download of %s incomplete at %lld of %lld bytes; it resumes on the next start\n", id,
+               offset + sink.total, total);
+    }
+}
+
+// Finishes a download left incomplete by an earlier run
+void resumePending(int client_socket) {
+    char id[64];
+    long long total;
+    FILE *resume = fopen(RESUME_FILE, "r");
+    if (resume == NULL) {
+        return;
+    }
+    int fields = fscanf(resume, "%63s %lld", id, &total);
+    fclose(resume);
+    struct stat st;
+    long long have = stat("temp.tar.gz", &st) == 0 ? st.st_size : 0;
+    if (fields != 2 || have >= total) {
+        unlink(RESUME_FILE);
+        return;
+    }
+    char command[128];
+    snprintf(command, sizeof(command), "w24get %s %lld", id, have);
+    sendRequest(client_socket, command);
+}
+
+// One node's share of a striped download
+typedef struct {
+    Reader *reader;
+    long long position;
+    long long end;
+    char id[64];
+} Stripe;
+
+const int stripe_ports[STRIPE_NODES] = {PORT, MIRROR1_PORT, MIRROR2_PORT};
+
+int isArchiveCommand(const char *command) {
+    return strncmp(command, "w24fz", 5) == 0 || strncmp(command, "w24fdb", 6) == 0 ||
+           strncmp(command, "w24fda", 6) == 0 || strncmp(command, "w24ft", 5) == 0 ||
+           (strncmp(command, "w24fq ", 6) == 0 && !isListQuery(command));
+}
+
+void closeStripes(Stripe *stripes, int count) {
+    for (int i = 0; i < count; i++) {
+        if (stripes[i].reader->fd != -1) {
+            close(stripes[i].reader->fd);
+        }
+        free(stripes[i].reader);
+    }
+}
+
+// Fetches the archive for command as equal byte ranges from every node at
+// once. All nodes build identical archives, which the matching cache keys in
+// their ids confirm. Returns -1 if striping is not possible or the download
+// fails, with no partial temp.tar.gz left behind, so the caller can fall back
+// to a plain request.
+int getTarfileStriped(const char *command) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Stripe stripes[STRIPE_NODES];
+    long long total = -1;
+    int opened = 0;
+    int agreed = 0;
+    for (; opened < STRIPE_NODES; opened++) {
+        Stripe *s = &stripes[opened];
+        s->reader = malloc(sizeof(Reader));
+        if (s->reader == NULL) {
+            break;
+        }
+        s->reader->start = s->reader->end = 0;
+        s->reader->fd = connectTo(SERVER_IP, stripe_ports[opened]);
+        char request[MAXDATASIZE + 32];
+        char header[256];
+        snprintf(request, sizeof(request), "w24stripe %d %d %s", opened, STRIPE_NODES, command);
+        if (s->reader->fd == -1 || sendCommand(s->reader->fd, request) == -1 ||
+            readLine(s->reader, header, sizeof(header)) == -1 || strncmp(header, "ARCHIVE ", 8) != 0 ||
+            headerField(header, "id", s->id, sizeof(s->id)) == -1) {
+            opened++;
+            break;
+        }
+        s->position = headerNumber(header, "offset", 0);
+        s->end = s->position + atoll(header + 8);
+        long long size = headerNumber(header, "total", -1);
+        const char *key = strchr(s->id, '.');
+        if (key == NULL || (opened > 0 && (size != total || strcmp(key, strchr(stripes[0].id, '.')) != 0))) {
+            note("Node %d built a different archive; not striping\n", opened);
+            opened++;
+            break;
+        }
+        total = size;
+        agreed++;
+    }
+    if (agreed < STRIPE_NODES) {
+        closeStripes(stripes, opened);
+        return -1;
+    }
+
+    int fd = open("temp.tar.gz", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *buffer = malloc(RECV_BUFFER_SIZE);
+    if (fd == -1 || buffer == NULL || ftruncate(fd, total) == -1) {
+        perror("Error opening tar file for writing");
+        closeStripes(stripes, opened);
+        free(buffer);
+        if (fd != -1) {
+            close(fd);
+            unlink("temp.tar.gz");
+        }
+        return -1;
+    }
+    int attempts = 0;
+    long long remaining = total;
+    while (remaining > 0) {
+        // Data left in a reader's buffer does not show up in poll, so serve it first
+        struct pollfd fds[STRIPE_NODES];
+        int timeout = -1;
+        for (int i = 0; i < STRIPE_NODES; i++) {
+            Reader *r = stripes[i].reader;
+            fds[i].fd = stripes[i].position < stripes[i].end ? r->fd : -1;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (fds[i].fd != -1 && r->start < r->end) {
+                timeout = 0;
+            }
+        }
+        if (poll(fds, STRIPE_NODES, timeout) == -1) {
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < STRIPE_NODES; i++) {
+            Stripe *s = &stripes[i];
+            if (fds[i].fd == -1 || (fds[i].revents == 0 && s->reader->start == s->reader->end)) {
+                continue;
+            }
+            long long want = s->end - s->position < RECV_BUFFER_SIZE ? s->end - s->position : RECV_BUFFER_SIZE;
+            ssize_t n = readSome(s->reader, buffer, want);
+            if (n > 0 && pwrite(fd, buffer, n, s->position) == n) {
+                s->position += n;
+                remaining -= n;
+                continue;
+            }
+            // Take the rest of this share from another node, which holds the same archive
+            if (attempts++ == RESUME_ATTEMPTS) {
+                remaining = -1;
+                break;
+            }
+            // Rotate through the other nodes, never back to the one that failed
+            char id[64];
+            int other = (i + 1 + (attempts - 1) % (STRIPE_NODES - 1)) % STRIPE_NODES;
+            snprintf(id, sizeof(id), "%.*s%s", (int)strcspn(stripes[other].id, "."), stripes[other].id,
+                     strchr(s->id, '.'));
+            note("Share %d cut off at byte %lld; fetching the rest from %s\n", i, s->position, id);
+            if (reopenRange(s->reader, id, s->position, s->end) == -1) {
+                close(s->reader->fd);
+                s->reader->fd = -1;
+                remaining = -1;
+                break;
+            }
+        }
+    }
+    closeStripes(stripes, STRIPE_NODES);
+    free(buffer);
+    close(fd);
+    double seconds = elapsedSeconds(&start);
+    if (remaining != 0) {
+        note("Striped download failed; fetching the archive with a plain request\n");
+        unlink("temp.tar.gz");
+        return -1;
+    }
+    note("Received temp.tar.gz: %lld bytes from %d nodes in %.3f s (%.2f MB/s)\n", total, STRIPE_NODES, seconds,
+         seconds > 0 ? total / seconds / (1024 * 1024) : 0.0);
+    return 0;
+}
+
+// Streaming XXH64, the strong block checksum of delta sync (same as the servers)
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    unsigned long long v[4];
+    unsigned long long total_len;
+    unsigned long long seed;
+    unsigned char mem[32];
+    size_t memsize;
+} Xxh64State;
+
+static unsigned long long xxhRotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long xxhRead64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long xxhRound(unsigned long long acc, unsigned long long input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxhRotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static unsigned long long xxhMergeRound(unsigned long long acc, unsigned long long val) {
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64Init(Xxh64State *st, unsigned long long seed) {
+    memset(st, 0, sizeof(*st));
+    st->seed = seed;
+    st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    st->v[1] = seed + XXH_PRIME64_2;
+    st->v[2] = seed;
+    st->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64Update(Xxh64State *st, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    st->total_len += len;
+    if (st->memsize + len < 32) {
+        memcpy(st->mem + st->memsize, p, len);
+        st->memsize += len;
+        return;
+    }
+    if (st->memsize > 0) {
+        size_t fill = 32 - st->memsize;
+        memcpy(st->mem + st->memsize, p, fill);
+        for (int i = 0; i < 4; i++) {
+            st->v[i] = xxhRound(st->v[i], xxhRead64(st->mem + i * 8));
+        }
+        p += fill;
+        st->memsize = 0;
+    }
+    while (p + 32 <= end) {
+        for (int i = 0; i < 4; i++) {
+            st->v[i] = xxhRound(st->v[i], xxhRead64(p + i * 8));
+        }
+        p += 32;
+    }
+    if (p < end) {
+        memcpy(st->mem, p, end - p);
+        st->memsize = end - p;
+    }
+}
+
+unsigned long long xxh64Digest(const Xxh64State *st) {
+    unsigned long long h;
+    if (st->total_len >= 32) {
+        h = xxhRotl(st->v[0], 1) + xxhRotl(st->v[1], 7) + xxhRotl(st->v[2], 12) + xxhRotl(st->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxhMergeRound(h, st->v[i]);
+        }
+    } else {
+        h = st->seed + XXH_PRIME64_5;
+    }
+    h += st->total_len;
+    const unsigned char *p = st->mem;
+    const unsigned char *end = p + st->memsize;
+    while (p + 8 <= end) {
+        h ^= xxhRound(0, xxhRead64(p));
+        h = xxhRotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        unsigned int k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (unsigned long long)k * XXH_PRIME64_1;
+        h = xxhRotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * XXH_PRIME64_5;
+        h = xxhRotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Cached metadata replies, one file per command in W24_META_DIR holding
+// "<etag> <command>\n" and then the reply text. The command is kept so that two
+// commands hashing alike cannot be mistaken for each other.
+const char *metaDir(void) {
+    const char *dir = getenv("W24_META_DIR");
+    return dir != NULL ? dir : META_DIR;
+}
+
+int metaPath(const char *command, char *path, size_t size) {
+    if (metaDir()[0] == '\0' || (strcmp(command, "dirlist -a") != 0 && strcmp(command, "dirlist -t") != 0 &&
+                                  strncmp(command, "w24fn ", 6) != 0)) {
+        return -1;
+    }
+    Xxh64State st;
+    xxh64Init(&st, 0);
+    xxh64Update(&st, command, strlen(command));
+    snprintf(path, size, "%s/%016llx", metaDir(), xxh64Digest(&st));
+    return 0;
+}
+
+// Reads the tag of the cached reply to command and, when length is given, its
+// text; type, when given, is set to the reply type ("text" or "records") it
+// came as. Returns a malloc'd string (empty without length), or NULL if nothing is cached.
+char *metaLoad(const char *command, char tag[17], long long *length, const char **type) {
+    char path[PATH_MAX], line[MAXDATASIZE + 32];
+    if (metaPath(command, path, sizeof(path)) == -1) {
+        return NULL;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    char *text = NULL;
+    struct stat sb;
+    if (fgets(line, sizeof(line), file) == NULL) {
+        line[0] = '\0';
+    }
+    line[strcspn(line, "\n")] = '\0';
+    // The first line is "<tag> <type> <command>"
+    const char *stored_type = NULL;
+    if (strlen(line) > 17 && line[16] == ' ') {
+        stored_type = strncmp(line + 17, "records ", 8) == 0 ? "records"
+                      : strncmp(line + 17, "text ", 5) == 0  ? "text"
+                                                              : NULL;
+    }
+    if (stored_type != NULL && strcmp(line + 18 + strlen(stored_type), command) == 0 && fstat(fileno(file), &sb) == 0) {
+        snprintf(tag, 17, "%.16s", line);
+        if (type != NULL) {
+            *type = stored_type;
+        }
+        long long size = sb.st_size - ftell(file);
+        text = malloc(length != NULL ? size + 1 : 1);
+        if (text != NULL && length != NULL && fread(text, 1, size, file) != (size_t)size) {
+            free(text);
+            text = NULL;
+        } else if (text != NULL) {
+            text[length != NULL ? size : 0] = '\0';
+            if (length != NULL) {
+                *length = size;
+            }
+        }
+    }
+    fclose(file);
+    return text;
+}
+
+// Keeps a reply for revalidation; written aside and renamed so readers never see half of it
+void metaStore(const char *command, const char *tag, const char *type, const char *text, long long length) {
+    char path[PATH_MAX], part_path[PATH_MAX + 16];
+    if (metaPath(command, path, sizeof(path)) == -1 || (mkdir(metaDir(), 0755) == -1 && errno != EEXIST)) {
+        return;
+    }
+    snprintf(part_path, sizeof(part_path), "%s.%d", path, (int)getpid());
+    FILE *file = fopen(part_path, "w");
+    if (file == NULL) {
+        return;
+    }
+    int ok = fprintf(file, "%s %s %s\n", tag, type, command) > 0 && fwrite(text, 1, length, file) == (size_t)length;
+    if (fclose(file) != 0 || !ok || rename(part_path, path) == -1) {
+        unlink(part_path);
+    }
+}
+
+// Delta sync keeps a local copy of query results below W24_SYNC_DIR. The
+// manifest lists every file held there with per-block checksums, and the reply
+// rebuilds changed files from new bytes and blocks of the old copy.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} TextBuffer;
+
+TextBuffer sync_manifest;
+size_t sync_root_len;
+
+const char *syncDir(void) {
+    const char *dir = getenv("W24_SYNC_DIR");
+    return dir != NULL && *dir != '\0' ? dir : SYNC_DIR;
+}
+
+int textAppend(TextBuffer *tb, const char *fmt, ...) {
+    va_list args;
+    while (1) {
+        size_t room = tb->capacity - tb->len;
+        va_start(args, fmt);
+        int n = vsnprintf(tb->data + tb->len, room, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < room) {
+            tb->len += n;
+            return 0;
+        }
+        size_t capacity = tb->capacity ? tb->capacity * 2 : 65536;
+        while (capacity - tb->len <= (size_t)n) {
+            capacity *= 2;
+        }
+        char *data = realloc(tb->data, capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        tb->data = data;
+        tb->capacity = capacity;
+    }
+}
+
+// rsync's rolling checksum of a block, as the server computes it
+unsigned int weakChecksum(const unsigned char *data, size_t len) {
+    unsigned int a = 0, b = 0;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += a;
+    }
+    return (a & 0xffff) | (b << 16);
+}
+
+// Blocks of about sqrt(size) keep both the checksum list and the literal data small
+size_t syncBlockSize(long long size) {
+    size_t block = (size_t)sqrt((double)size);
+    block = (block + SYNC_MIN_BLOCK - 1) / SYNC_MIN_BLOCK * SYNC_MIN_BLOCK;
+    return block < SYNC_MIN_BLOCK ? SYNC_MIN_BLOCK : block > SYNC_MAX_BLOCK ? SYNC_MAX_BLOCK : block;
+}
+
+// nftw callback adding one held file and its block checksums to the manifest
+int manifestAddFile(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+    const char *path = fpath + sync_root_len + 1;
+    size_t path_len = strlen(path);
+    if (typeflag != FTW_F || strpbrk(path, "\t\n") != NULL ||
+        (path_len > 8 && strcmp(path + path_len - 8, ".w24part") == 0)) {
+        return 0;
+    }
+    int fd = open(fpath, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    size_t block_size = syncBlockSize(sb->st_size);
+    size_t blocks = (sb->st_size + block_size - 1) / block_size;
+    textAppend(&sync_manifest, "%s\t%lld %lld %ld %zu %zu\n", path, (long long)sb->st_size,
+               (long long)sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec, block_size, blocks);
+    unsigned char *block = malloc(block_size);
+    for (size_t i = 0; block != NULL && i < blocks; i++) {
+        ssize_t n = pread(fd, block, block_size, (off_t)i * block_size);
+        if (n <= 0) {
+            // Shrunk while being read; an unchecked short list is still valid
+            n = 0;
+        }
+        Xxh64State st;
+        xxh64Init(&st, 0);
+        xxh64Update(&st, block, n);
+        textAppend(&sync_manifest, "%x %llx\n", weakChecksum(block, n), xxh64Digest(&st));
+    }
+    free(block);
+    close(fd);
+    return 0;
+}
+
+// Creates the missing parent directories of path
+void makeParents(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0755);
+        *p = '/';
+    }
+}
+
+// Rebuilds files from the "FILE"/"LIT"/"COPY"/"END" records of a delta reply
+void applyDelta(Reader *r) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char line[PATH_MAX + 128] = "";
+    char *buffer = malloc(RECV_BUFFER_SIZE);
+    int files = 0;
+    long long literal_bytes = 0, copied_bytes = 0;
+    while (buffer != NULL && readLine(r, line, sizeof(line)) == 0 && strcmp(line, "DONE") != 0) {
+        long long size, mtime_sec, mtime_nsec, block_size;
+        int consumed = 0;
+        if (sscanf(line, "FILE %lld %lld %lld %lld %n", &size, &mtime_sec, &mtime_nsec, &block_size, &consumed) < 4 ||
+            consumed == 0) {
+            note("Unexpected delta record: %s\n", line);
+            break;
+        }
+        // Member names are relative to the server's home; keep them inside the sync directory
+        const char *name = line + consumed;
+        if (!safeMemberName(name)) {
+            note("Refusing unsafe path %s\n", name);
+            break;
+        }
+        char path[PATH_MAX + 64], part_path[PATH_MAX + 80];
+        snprintf(path, sizeof(path), "%s/%s", syncDir(), name);
+        snprintf(part_path, sizeof(part_path), "%s.w24part", path);
+        makeParents(path);
+        int old_fd = open(path, O_RDONLY);
+        struct stat old_st;
+        if (old_fd != -1 && fstat(old_fd, &old_st) == -1) {
+            close(old_fd);
+            old_fd = -1;
+        }
+        int fd = open(part_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("Error creating synced file");
+            if (old_fd != -1) {
+                close(old_fd);
+            }
             break;
-        } else if (bytes_received == 0) {
-            printf("Server closed connection.\n");
+        }
+        int ok = 1;
+        while (ok && (ok = readLine(r, line, sizeof(line)) == 0) && strcmp(line, "END") != 0) {
+            long long first, count;
+            if (sscanf(line, "LIT %lld", &count) == 1) {
+                literal_bytes += count;
+                while (ok && count > 0) {
+                    ssize_t n = readSome(r, buffer, count < RECV_BUFFER_SIZE ? count : RECV_BUFFER_SIZE);
+                    ok = n > 0 && write(fd, buffer, n) == n;
+                    count -= n;
+                }
+            } else if (sscanf(line, "COPY %lld %lld", &first, &count) == 2 && old_fd != -1) {
+                off_t offset = first * block_size;
+                off_t end = offset + count * block_size;
+                if (end > old_st.st_size) {
+                    end = old_st.st_size; // the last block of the old copy may be short
+                }
+                // A reflink shares the old copy's extents (btrfs, XFS); it needs block-aligned
+                // offsets, so a run that follows an odd-sized literal falls through
+                off_t position = lseek(fd, 0, SEEK_CUR);
+                struct file_clone_range clone = {old_fd, offset, end - offset, position};
+                if (offset < end && position != -1 && ioctl(fd, FICLONERANGE, &clone) == 0 &&
+                    lseek(fd, end - offset, SEEK_CUR) != -1) {
+                    copied_bytes += end - offset;
+                    offset = end;
+                }
+                // Otherwise let the kernel copy without passing the blocks through user space
+                while (ok && offset < end) {
+                    ssize_t n = copy_file_range(old_fd, &offset, fd, NULL, end - offset, 0);
+                    if (n <= 0) {
+                        // Unsupported here (EXDEV, ENOSYS, EINVAL): read and write the rest
+                        ok = n == 0 || errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP;
+                        break;
+                    }
+                    copied_bytes += n;
+                }
+                while (ok && offset < end) {
+                    ssize_t n = pread(old_fd, buffer, end - offset < RECV_BUFFER_SIZE ? end - offset : RECV_BUFFER_SIZE,
+                                      offset);
+                    if (n == 0) {
+                        break; // the old copy shrank while being read
+                    }
+                    ok = n > 0 && write(fd, buffer, n) == n;
+                    offset += n;
+                    copied_bytes += n;
+                }
+            } else {
+                note("Unexpected delta record: %s\n", line);
+                ok = 0;
+            }
+        }
+        if (old_fd != -1) {
+            close(old_fd);
+        }
+        // Carry the server's mtime so that the next manifest shows the file unchanged
+        struct timespec times[2] = {{mtime_sec, mtime_nsec}, {mtime_sec, mtime_nsec}};
+        if (!ok || futimens(fd, times) == -1 || close(fd) == -1 || rename(part_path, path) == -1) {
+            perror("Error writing synced file");
+            unlink(part_path);
             break;
         }
-        fwrite(buffer, 1, bytes_received, tar_file);
-        total_received += bytes_received;
+        files++;
     }
+    last_reply.type = "delta";
+    last_reply.ok = buffer != NULL && strcmp(line, "DONE") == 0;
+    free(buffer);
+    double seconds = elapsedSeconds(&start);
+    note("Synced %d files into %s: %lld new bytes, %lld reused from local copies, in %.3f s\n", files, syncDir(),
+           literal_bytes, copied_bytes, seconds);
+}
 
-    // Close the file
-    fclose(tar_file);
+// Runs an archive command as a delta sync against the files held in the sync directory
+void syncRequest(int client_socket, const char *command) {
+    char header[256];
+    char request[MAXDATASIZE + 32];
+    sync_manifest.len = 0;
+    sync_root_len = strlen(syncDir());
+    mkdir(syncDir(), 0755);
+    if (textAppend(&sync_manifest, "%s", "") == -1 || nftw(syncDir(), manifestAddFile, 16, FTW_PHYS) == -1) {
+        perror("Error building sync manifest");
+        return;
+    }
+    snprintf(request, sizeof(request), "w24sync %zu %s", sync_manifest.len, command);
+    note("Sending command to server: %s\n", request);
+    if (sendCommand(client_socket, request) == -1 || readLine(&reader, header, sizeof(header)) == -1) {
+        note("Server closed the connection\n");
+        return;
+    }
+    if (strcmp(header, "READY") == 0) {
+        for (size_t sent = 0; sent < sync_manifest.len;) {
+            ssize_t n = send(client_socket, sync_manifest.data + sent, sync_manifest.len - sent, 0);
+            if (n <= 0) {
+                perror("Send failed");
+                return;
+            }
+            sent += n;
+        }
+        note("Sent manifest: %zu bytes\n", sync_manifest.len);
+        if (readLine(&reader, header, sizeof(header)) == -1) {
+            note("Server closed the connection\n");
+            return;
+        }
+    }
+    if (strncmp(header, "DELTA ", 6) == 0) {
+        note("Received delta: %lld bytes\n", atoll(header + 6));
+        applyDelta(&reader);
+        last_reply.bytes = atoll(header + 6);
+    } else {
+        receiveText(&reader, header);
+    }
+}
+
+// Receives a tar file sent as "<hex length>\n<bytes>" chunks ending with a zero-length chunk
+void getTarfileChunked(Reader *r) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    TarSink sink;
+    if (sinkOpen(&sink, 0) == -1) {
+        return;
+    }
+    char line[32];
+    while (readLine(r, line, sizeof(line)) == 0) {
+        long long length = strtoll(line, NULL, 16);
+        if (length == 0 || sinkReceive(&sink, r, length) == -1) {
+            break;
+        }
+    }
+    sinkClose(&sink, &start);
 }
 
 void getandCreateTar(int client_socket) {
@@ -155,9 +1518,197 @@ void getandCreateTar(int client_socket) {
     }
 }
  
-int main() {
+// Command syntax check shared by interactive and batch mode
+int validCommand(const char *command) {
+    return strcmp(command, "dirlist -a") == 0 || strcmp(command, "dirlist -t") == 0 ||
+           strcmp(command, "quitc") == 0 || strncmp(command, "w24fn ", 6) == 0 ||
+           strncmp(command, "w24fz", 5) == 0 || strncmp(command, "w24fdb", 6) == 0 ||
+           strncmp(command, "w24fda", 6) == 0 || strncmp(command, "w24ft", 5) == 0 ||
+           strncmp(command, "w24fq ", 6) == 0 || strncmp(command, "w24get ", 7) == 0 ||
+           strcmp(command, "stats") == 0 || strncmp(command, "stats ", 6) == 0 ||
+           (strncmp(command, "w24sync ", 8) == 0 && isArchiveCommand(command + 8));
+}
+
+void jsonString(const char *s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\') {
+            printf("\\%c", ch);
+        } else if (ch == '\n') {
+            fputs("\\n", stdout);
+        } else if (ch < 0x20) {
+            printf("\\u%04x", ch);
+        } else {
+            putchar(ch);
+        }
+    }
+    putchar('"');
+}
+
+// One JSON line per batch command, in command order
+void printResult(int seq, const char *command, const char *rid, const char *error, double seconds) {
+    int ok = error == NULL && last_reply.ok;
+    printf("{\"seq\":%d,\"command\":", seq);
+    jsonString(command);
+    if (rid != NULL && rid[0] != '\0') {
+        printf(",\"rid\":");
+        jsonString(rid);
+    }
+    printf(",\"status\":\"%s\"", ok ? "ok" : "error");
+    if (error == NULL && last_reply.type != NULL) {
+        printf(",\"type\":\"%s\",\"bytes\":%lld", last_reply.type, last_reply.bytes);
+    }
+    if (error == NULL && last_reply.id[0] != '\0') {
+        printf(",\"id\":");
+        jsonString(last_reply.id);
+    }
+    if (error == NULL && last_reply.text != NULL) {
+        printf(",\"text\":");
+        jsonString(last_reply.text);
+    }
+    if (error == NULL && last_reply.cached) {
+        printf(",\"cached\":true");
+    }
+    if (!ok) {
+        printf(",\"error\":");
+        jsonString(error != NULL ? error : "incomplete reply");
+    }
+    printf(",\"ms\":%.3f}\n", seconds * 1000);
+    fflush(stdout);
+}
+
+// Plain commands can be sent ahead of earlier replies; w24sync needs a dialogue
+int pipelinable(const char *command) {
+    return validCommand(command) && strcmp(command, "quitc") != 0 && strncmp(command, "w24sync ", 8) != 0;
+}
+
+// Runs commands over one connection, keeping up to BATCH_WINDOW of them in
+// flight. The first command goes alone so a server that predates '\n'-framed
+// commands is never sent two at once. Returns the number of failed commands.
+int runBatch(int client_socket, char **commands, int count) {
+    struct timespec *sent_at = calloc(count, sizeof(struct timespec));
+    char (*rids)[sizeof(sent_rid)] = calloc(count, sizeof(sent_rid));
+    int failures = 0;
+    int next = 0; // first command not sent yet
+    int broken = 0; // a send failed, so nothing after next can be sent
+    if (sent_at == NULL || rids == NULL) {
+        perror("Memory allocation failed");
+        free(sent_at);
+        free(rids);
+        return count;
+    }
+    for (int done = 0; done < count; done++) {
+        const char *command = commands[done];
+        int window = done == 0 ? 1 : BATCH_WINDOW;
+        while (!broken && next < count && next - done < window && pipelinable(commands[next])) {
+            clock_gettime(CLOCK_MONOTONIC, &sent_at[next]);
+            if (sendCommand(client_socket, commands[next]) == -1) {
+                broken = 1;
+                break;
+            }
+            memcpy(rids[next], sent_rid, sizeof(sent_rid));
+            next++;
+        }
+        replyReset();
+        if (broken && next == done) {
+            // The replies already in flight have been read; the rest were never sent
+            for (; done < count; done++) {
+                printResult(done + 1, commands[done], NULL, "send failed", 0);
+                failures++;
+            }
+            break;
+        } else if (next > done) {
+            if (receiveReply(&reader, command) == -1) {
+                // Nothing more will come back on this connection
+                for (; done < count; done++) {
+                    printResult(done + 1, commands[done], rids[done], "connection closed", 0);
+                    failures++;
+                }
+                break;
+            }
+            printResult(done + 1, command, rids[done], NULL, elapsedSeconds(&sent_at[done]));
+        } else if (strcmp(command, "quitc") == 0) {
+            sendCommand(client_socket, command);
+            break;
+        } else if (validCommand(command) && strncmp(command, "w24sync ", 8) == 0) {
+            struct timespec start;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            syncRequest(client_socket, command + 8);
+            printResult(done + 1, command, sent_rid, NULL, elapsedSeconds(&start));
+            next = done + 1;
+        } else {
+            printResult(done + 1, command, NULL, "invalid command", 0);
+            next = done + 1;
+        }
+        failures += !last_reply.ok;
+    }
+    replyReset();
+    free(sent_at);
+    free(rids);
+    return failures;
+}
+
+// Appends the non-empty lines of a batch file ("-" for stdin) to the command list
+int readBatchFile(const char *path, char ***commands, int *count) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, in) != -1) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (strlen(line) >= MAXDATASIZE) {
+            fprintf(stderr, "Command too long: %.40s...\n", line);
+            free(line);
+            return -1;
+        }
+        char **grown = realloc(*commands, (*count + 1) * sizeof(char *));
+        if (grown == NULL) {
+            perror("Memory allocation failed");
+            free(line);
+            return -1;
+        }
+        *commands = grown;
+        (*commands)[(*count)++] = strdup(line);
+    }
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
     int client_socket;
     char command[MAXDATASIZE];
+    char **commands = NULL;
+    int command_count = 0;
+
+    // clientw24 [-b <file|->] [-c <command>]... runs commands without prompting
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && strlen(argv[i + 1]) < MAXDATASIZE) {
+            char **grown = realloc(commands, (command_count + 1) * sizeof(char *));
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            commands = grown;
+            commands[command_count++] = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            if (readBatchFile(argv[++i], &commands, &command_count) == -1) {
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [-b <file|->] [-c <command>]...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    batch_mode = argc > 1;
  
     // Establish connection to the server
     client_socket = makeConnection();
@@ -165,26 +1716,51 @@ int main() {
         fprintf(stderr, "Failed to establish connection to the server\n");
         exit(EXIT_FAILURE);
     }
+    reader.fd = client_socket;
+    if (batch_mode) {
+        int failures = runBatch(client_socket, commands, command_count);
+        close(client_socket);
+        return failures > 0 ? EXIT_FAILURE : 0;
+    }
+    resumePending(client_socket);
+    client_socket = reader.fd;
  
     // Inside main function
     while (1) {
         printf("Enter command: ");
-        fgets(command, MAXDATASIZE, stdin);
+        // End of input quits, so commands can also be piped in
+        if (fgets(command, MAXDATASIZE, stdin) == NULL) {
+            strcpy(command, "quitc");
+        }
         command[strcspn(command, "\n")] = '\0';
  
     // Validate command syntax
-    if (strcmp(command, "dirlist -a") != 0 && strcmp(command, "dirlist -t") != 0 &&
-    strcmp(command, "quitc") != 0 && strncmp(command, "w24fn ", 6) != 0 &&
-    strncmp(command, "w24fz", 5) != 0  && strncmp(command, "w24fdb", 6) != 0 &&
-    strncmp(command, "w24fda", 6) != 0 && strncmp(command, "w24ft", 5) != 0) {
-    printf("Invalid command. Please enter a valid command\n");
+    if (!validCommand(command)) {
+        if (strncmp(command, "w24sync ", 8) == 0) {
+            printf("w24sync takes an archive command, e.g. w24sync w24fda 2024-01-01\n");
+        } else {
+            printf("Invalid command. Please enter a valid command\n");
+        }
     continue;
     }
 
 
  
+        if (strncmp(command, "w24sync ", 8) == 0) {
+            syncRequest(client_socket, command + 8);
+            continue;
+        }
+
+        // With W24_STRIPE set, archives come from all nodes at once when they agree on it
+        if (getenv("W24_STRIPE") != NULL && extractDir() == NULL && isArchiveCommand(command) &&
+            getTarfileStriped(command) == 0) {
+            continue;
+        }
+
         // Send command to server and receive response
         sendRequest(client_socket, command);
+        // A resumed download may have moved to a new connection
+        client_socket = reader.fd;
  
         // Check if quit command is entered
         if (strcmp(command, "quitc") == 0) {
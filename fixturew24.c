@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BLOCK_SIZE (1024 * 1024) // content is cut from blocks of this size
+#define MAX_EXTENSIONS 32
+#define MAX_DIRS 10000000 // directories a tree may have
+#define DEFAULT_END_DATE "2024-06-01" // newest mtime, so date queries give the same results every run
+
+// Generates a directory tree of a chosen shape for scale tests. Point the
+// nodes at it with W24_ROOT=<dir>, and seekbenchw24 or loadw24 give numbers
+// that can be compared across builds. The same options and seed always give
+// the same names, sizes, contents and mtimes, however many jobs write them.
+//
+//   fixturew24 <dir> [-n files] [-d depth] [-f fanout] [-s sizes] [-x extensions]
+//              [-m days] [-t end-date] [-S seed] [-j jobs]
+//
+// sizes:      fixed:<size>, uniform:<min>-<max> or lognormal:<median>:<sigma>[:<max>]
+//             (sizes take K, M and G suffixes; default lognormal:4K:1.5:64M)
+// extensions: weighted mix, default txt:4,c:2,md:1,pdf:1,jpg:1,gz:1
+// days:       mtimes are spread evenly over this many days up to the end date (default 365)
+
+typedef struct {
+    char name[16];
+    int weight;
+    int incompressible; // filled with random bytes rather than text
+} Extension;
+
+typedef struct {
+    enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOGNORMAL } kind;
+    double a, b, max;
+} SizeSpec;
+
+// The extensions serverw24 stores without compressing
+static const char *incompressible_exts[] = {
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "mp4", "m4a", "m4v", "mkv",
+    "mov", "avi", "webm", "ogg", "flac", "gz", "tgz", "bz2", "xz", "zst", "lz4",
+    "zip", "7z", "rar", "jar", "docx", "xlsx", "pptx", "odt", NULL
+};
+
+Extension extensions[MAX_EXTENSIONS];
+int extension_count;
+int extension_total;
+SizeSpec sizes = {SIZE_LOGNORMAL, 4096, 1.5, 64.0 * 1024 * 1024};
+unsigned long long seed = 1;
+long long mtime_end;
+double mtime_days = 365;
+
+unsigned char *text_block;
+unsigned char *random_block;
+
+// splitmix64: each file's values come from its own index, independent of job order
+unsigned long long mix64(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+double unit(unsigned long long *state) {
+    *state = mix64(*state);
+    return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+long long parseSize(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    switch (*end) {
+    case 'K':
+    case 'k':
+        value *= 1024;
+        break;
+    case 'M':
+    case 'm':
+        value *= 1024 * 1024;
+        break;
+    case 'G':
+    case 'g':
+        value *= 1024.0 * 1024 * 1024;
+        break;
+    }
+    return (long long)value;
+}
+
+int parseSizes(const char *spec) {
+    char copy[128];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    char *kind = strtok(copy, ":");
+    char *first = strtok(NULL, ":");
+    char *second = strtok(NULL, ":");
+    char *third = strtok(NULL, ":");
+    if (kind == NULL || first == NULL) {
+        return -1;
+    }
+    if (strcmp(kind, "fixed") == 0) {
+        sizes.kind = SIZE_FIXED;
+        sizes.a = parseSize(first);
+    } else if (strcmp(kind, "uniform") == 0 && strchr(first, '-') != NULL) {
+        sizes.kind = SIZE_UNIFORM;
+        sizes.a = parseSize(first);
+        sizes.b = parseSize(strchr(first, '-') + 1);
+    } else if (strcmp(kind, "lognormal") == 0 && second != NULL) {
+        sizes.kind = SIZE_LOGNORMAL;
+        sizes.a = parseSize(first);
+        sizes.b = atof(second);
+        sizes.max = third != NULL ? parseSize(third) : 64.0 * 1024 * 1024;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int parseExtensions(const char *spec) {
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    extension_count = 0;
+    extension_total = 0;
+    for (char *item = strtok(copy, ","); item != NULL && extension_count < MAX_EXTENSIONS; item = strtok(NULL, ",")) {
+        Extension *e = &extensions[extension_count];
+        char *colon = strchr(item, ':');
+        e->weight = colon != NULL ? atoi(colon + 1) : 1;
+        if (colon != NULL) {
+            *colon = '\0';
+        }
+        if (e->weight <= 0 || strlen(item) == 0 || strlen(item) >= sizeof(e->name)) {
+            return -1;
+        }
+        snprintf(e->name, sizeof(e->name), "%s", item);
+        e->incompressible = 0;
+        for (int i = 0; incompressible_exts[i] != NULL; i++) {
+            e->incompressible |= strcasecmp(item, incompressible_exts[i]) == 0;
+        }
+        extension_total += e->weight;
+        extension_count++;
+    }
+    return extension_count > 0 ? 0 : -1;
+}
+
+// Compressible pseudo-text and incompressible bytes; files are cut from these
+void fillBlocks(void) {
+    static const char *words[] = {"the", "server", "archive", "mirror", "client", "request", "file", "directory",
+                                  "size", "date", "of", "and", "to", "in", "is", "for", "with", "on", "data", "time"};
+    unsigned long long state = seed;
+    text_block = malloc(BLOCK_SIZE);
+    random_block = malloc(BLOCK_SIZE);
+    if (text_block == NULL || random_block == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t used = 0;
+    while (used < BLOCK_SIZE) {
+        state = mix64(state);
+        const char *word = words[state % (sizeof(words) / sizeof(words[0]))];
+        size_t len = strlen(word);
+        for (size_t i = 0; i <= len && used < BLOCK_SIZE; i++) {
+            text_block[used++] = i < len ? word[i] : ((state >> 32) % 12 == 0 ? '\n' : ' ');
+        }
+    }
+    for (size_t i = 0; i < BLOCK_SIZE; i += 8) {
+        state = mix64(state);
+        memcpy(random_block + i, &state, 8);
+    }
+}
+
+long long fileSize(unsigned long long *state) {
+    switch (sizes.kind) {
+    case SIZE_FIXED:
+        return (long long)sizes.a;
+    case SIZE_UNIFORM:
+        return (long long)(sizes.a + unit(state) * (sizes.b - sizes.a + 1));
+    default: {
+        // Box-Muller normal sample
+        double u1 = unit(state), u2 = unit(state);
+        double normal = sqrt(-2 * log(u1 > 0 ? u1 : 1e-300)) * cos(2 * M_PI * u2);
+        double size = sizes.a * exp(sizes.b * normal);
+        return (long long)(size < sizes.max ? size : sizes.max);
+    }
+    }
+}
+
+// Number of directories in a tree of the given depth and fanout, root included
+long long dirCount(int depth, int fanout) {
+    long long total = 0, level = 1;
+    for (int d = 0; d <= depth && total <= MAX_DIRS; d++) {
+        total += level;
+        level *= fanout;
+    }
+    return total;
+}
+
+// Directory k in depth-first order, as a path relative to the root
+void dirPath(long long k, int depth, int fanout, char *path, size_t size) {
+    path[0] = '\0';
+    size_t used = 0;
+    for (int d = 1; d <= depth && k > 0; d++) {
+        k--; // step into the subtree
+        long long subtree = dirCount(depth - d, fanout);
+        long long child = k / subtree;
+        k %= subtree;
+        used += snprintf(path + used, size - used, "%sd%02lld", used > 0 ? "/" : "", child);
+    }
+}
+
+int makeTree(const char *root, int depth, int fanout, long long dirs) {
+    char path[PATH_MAX], full[PATH_MAX * 2];
+    if (mkdir(root, 0755) == -1 && errno != EEXIST) {
+        perror(root);
+        return -1;
+    }
+    for (long long k = 1; k < dirs; k++) {
+        dirPath(k, depth, fanout, path, sizeof(path));
+        snprintf(full, sizeof(full), "%s/%s", root, path);
+        if (mkdir(full, 0755) == -1 && errno != EEXIST) {
+            perror(full);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const Extension *extension;
+    long long size;
+    size_t offset; // where in its block the content starts
+    time_t mtime;
+} FilePlan;
+
+// Everything about file index, derived from the seed and the index alone
+void planFile(long long index, FilePlan *plan) {
+    unsigned long long state = mix64(seed ^ mix64(index));
+    int r = (int)(unit(&state) * extension_total);
+    plan->extension = &extensions[extension_count - 1];
+    for (int i = 0; i < extension_count; i++) {
+        if ((r -= extensions[i].weight) < 0) {
+            plan->extension = &extensions[i];
+            break;
+        }
+    }
+    plan->size = fileSize(&state);
+    plan->offset = (size_t)(unit(&state) * BLOCK_SIZE);
+    plan->mtime = mtime_end - (long long)(unit(&state) * mtime_days * 86400);
+}
+
+// Writes files first..first+count-1 into directory dir_fd
+int writeFiles(int dir_fd, long long first, long long count) {
+    for (long long index = first; index < first + count; index++) {
+        FilePlan plan;
+        planFile(index, &plan);
+        const Extension *e = plan.extension;
+        long long size = plan.size;
+        const unsigned char *block = e->incompressible ? random_block : text_block;
+        size_t offset = plan.offset;
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = plan.mtime;
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+
+        char name[64];
+        snprintf(name, sizeof(name), "f%08lld.%s", index, e->name);
+        int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(name);
+            return -1;
+        }
+        for (long long written = 0; written < size;) {
+            size_t n = BLOCK_SIZE - offset;
+            if ((long long)n > size - written) {
+                n = size - written;
+            }
+            if (write(fd, block + offset, n) != (ssize_t)n) {
+                perror(name);
+                close(fd);
+                return -1;
+            }
+            written += n;
+            offset = 0;
+        }
+        futimens(fd, times);
+        close(fd);
+    }
+    return 0;
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    long long files = 10000;
+    int depth = 3, fanout = 8, jobs = 1;
+    const char *end_date = DEFAULT_END_DATE;
+    const char *size_spec = "lognormal:4K:1.5:64M";
+    const char *extension_spec = "txt:4,c:2,md:1,pdf:1,jpg:1,gz:1";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:f:s:x:m:t:S:j:")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = atoll(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'f':
+            fanout = atoi(optarg);
+            break;
+        case 's':
+            size_spec = optarg;
+            break;
+        case 'x':
+            extension_spec = optarg;
+            break;
+        case 'm':
+            mtime_days = atof(optarg);
+            break;
+        case 't':
+            end_date = optarg;
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    if (optind != argc - 1 || files < 0 || depth < 0 || fanout < 1 || jobs < 1 || parseSizes(size_spec) == -1 ||
+        parseExtensions(extension_spec) == -1 || strptime(end_date, "%Y-%m-%d", &tm) == NULL) {
+        fprintf(stderr,
+                "Usage: %s <dir> [-n files] [-d depth] [-f fanout] [-s sizes] [-x extensions]\n"
+                "          [-m days] [-t end-date] [-S seed] [-j jobs]\n",
+                argv[0]);
+        return 1;
+    }
+    tm.tm_isdst = -1;
+    mtime_end = mktime(&tm);
+    const char *root = argv[optind];
+    long long dirs = dirCount(depth, fanout);
+    if (dirs > MAX_DIRS) {
+        fprintf(stderr, "A tree of depth %d and fanout %d has more than %d directories\n", depth, fanout, MAX_DIRS);
+        return 1;
+    }
+
+    double start = now();
+    fillBlocks();
+    if (makeTree(root, depth, fanout, dirs) == -1) {
+        return 1;
+    }
+    // Directory k holds files_per_dir files, plus one of the remainder for the first ones
+    long long per_dir = files / dirs, extra = files % dirs;
+    for (int job = 0; job < jobs; job++) {
+        pid_t pid = jobs > 1 ? fork() : 0;
+        if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        if (pid > 0) {
+            continue;
+        }
+        char path[PATH_MAX], full[PATH_MAX * 2];
+        for (long long k = job; k < dirs; k += jobs) {
+            long long first = k * per_dir + (k < extra ? k : extra);
+            long long count = per_dir + (k < extra);
+            if (count == 0) {
+                continue;
+            }
+            dirPath(k, depth, fanout, path, sizeof(path));
+            snprintf(full, sizeof(full), "%s/%s", root, path);
+            int dir_fd = open(full, O_RDONLY | O_DIRECTORY);
+            if (dir_fd == -1 || writeFiles(dir_fd, first, count) == -1) {
+                if (dir_fd == -1) {
+                    perror(full);
+                }
+                exit(1);
+            }
+            close(dir_fd);
+        }
+        if (jobs > 1) {
+            exit(0);
+        }
+    }
+    int failed = 0, status;
+    while (jobs > 1 && wait(&status) > 0) {
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double seconds = now() - start;
+    long long bytes = 0;
+    for (long long index = 0; index < files; index++) {
+        FilePlan plan;
+        planFile(index, &plan);
+        bytes += plan.size;
+    }
+    printf("%lld files in %lld directories, %lld bytes, under %s in %.3f s (%d jobs)%s\n", files, dirs, bytes, root,
+           seconds, jobs, failed ? "; some jobs failed" : "");
+    return failed;
+}
@@ -0,0 +1,904 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SERVER_IP "127.0.0.1"
+#define PORT 8888
+#define MAX_MIX 32 // commands in the mix
+#define MAX_KEYS 256 // (command, node) pairs reported
+#define HEADER_MAX 256
+#define RECV_BUFFER_SIZE (256 * 1024)
+#define DRAIN_SECONDS 30 // how long replies still in flight are awaited after the run
+#define CAPTURE_MAGIC "W24CAP1\n"
+#define CAPTURE_HEADER_SIZE 16
+
+// Load generator for serverw24. Opens N connections (routed to the nodes as
+// any client would be) and sends a weighted mix of commands over them, then
+// reports throughput and latency percentiles per command and per node that
+// answered.
+//
+// Closed loop (default): each connection sends its next command when the
+// previous reply is complete. Open loop (-r): commands are issued at a fixed
+// total rate, round-robin over the connections and pipelined behind any
+// still in flight, and latency is measured from when each command was due.
+// A slow server therefore shows up as latency instead of as fewer requests,
+// so the percentiles are free of coordinated omission.
+//
+// Replay (-R): replays a capture written by serverw24 with W24_CAPTURE=<file>
+// instead of a mix. Every captured connection is opened, sent its commands and
+// closed in the captured order and at the captured offsets, divided by the
+// speed factor (-S 2 replays twice as fast, -S 0 as fast as it can). Since
+// nodes route by connection count, a freshly started cluster sends every
+// command to the node it went to when it was captured; replies that come from
+// another node are counted as rerouted. Commands are pipelined and timed from
+// when they were due, as in open loop. w24sync needs the client's manifest,
+// which is not captured, so it is skipped, as are commands the server cut
+// short; quitc, which has no reply, closes the connection instead of being
+// sent.
+//
+//   loadw24 [-c connections] [-d seconds] [-n requests] [-r rate/s]
+//           [-x "<weight> <command>"]... [-h host] [-p port] [-s seed]
+//   loadw24 -R <capture> [-S speed] [-l] [-h host] [-p port]
+//
+// -l lists the capture instead of replaying it.
+
+enum { CAPTURE_ACCEPT, CAPTURE_COMMAND, CAPTURE_CLOSE };
+#define CAPTURE_TRUNCATED 0x80 // set in the kind of a command that serverw24 cut to fit its buffer
+
+typedef struct {
+    int weight;
+    char command[256];
+    char name[32]; // reported as: first word, plus the flag for dirlist
+} MixEntry;
+
+// A record of a capture
+typedef struct {
+    double t; // seconds since the first record
+    unsigned int connection;
+    int kind;
+    int truncated;
+    int destination;
+    size_t order; // position in the file, which breaks ties in time
+    char command[1025];
+    char name[32]; // reported as: first word, plus the flag for dirlist
+} Record;
+
+typedef struct {
+    char name[32];
+    char node[32];
+    double *latencies; // seconds
+    size_t count;
+    size_t capacity;
+    long long bytes;
+} Series;
+
+typedef struct {
+    int fd;
+    int closing; // the captured connection ended; close once its replies are in
+    char *out; // commands not yet written
+    size_t out_len, out_capacity;
+    // Commands in flight, oldest first, as indexes into mix (or records when replaying)
+    int *item;
+    double *due;
+    size_t head, tail, capacity;
+    // Reply parser
+    enum { READ_HEADER, READ_BODY, READ_CHUNK_LINE, READ_CHUNK_BODY } state;
+    char header[HEADER_MAX]; // of the reply being read
+    char line[HEADER_MAX]; // header or chunk length line, as far as it has arrived
+    size_t line_len;
+    long long left;
+    long long reply_bytes;
+    char node[32]; // node named by the last reply on this connection
+} Conn;
+
+const char *destination_names[] = {"serverw24", "mirror1", "mirror2"};
+
+MixEntry mix[MAX_MIX];
+int mix_count;
+int mix_total;
+Record *records; // set when replaying a capture
+size_t record_count;
+Series series[MAX_KEYS];
+int series_count;
+long long errors;
+long long rerouted;
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void addMix(int weight, const char *command) {
+    if (mix_count == MAX_MIX || weight <= 0) {
+        return;
+    }
+    MixEntry *m = &mix[mix_count++];
+    m->weight = weight;
+    snprintf(m->command, sizeof(m->command), "%s", command);
+    int len = strncmp(command, "dirlist ", 8) == 0 ? 10 : (int)strcspn(command, " ");
+    snprintf(m->name, sizeof(m->name), "%.*s", len, command);
+    mix_total += weight;
+}
+
+int pickMix(unsigned int *seed) {
+    int r = rand_r(seed) % mix_total;
+    for (int i = 0; i < mix_count; i++) {
+        if ((r -= mix[i].weight) < 0) {
+            return i;
+        }
+    }
+    return mix_count - 1;
+}
+
+unsigned long long readLittle(const unsigned char *p, int bytes) {
+    unsigned long long value = 0;
+    for (int i = bytes - 1; i >= 0; i--) {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+int recordCompare(const void *a, const void *b) {
+    const Record *x = a, *y = b;
+    if (x->t != y->t) {
+        return x->t < y->t ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Reads the whole capture into records, sorted by time
+int loadCapture(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        return -1;
+    }
+    unsigned char *data = malloc(st.st_size + 1);
+    size_t size = 0;
+    while (data != NULL && size < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + size, st.st_size - size);
+        if (n <= 0) {
+            break;
+        }
+        size += n;
+    }
+    close(fd);
+    size_t magic = strlen(CAPTURE_MAGIC);
+    if (data == NULL || size < magic || memcmp(data, CAPTURE_MAGIC, magic) != 0) {
+        fprintf(stderr, "%s is not a serverw24 capture\n", path);
+        free(data);
+        return -1;
+    }
+    size_t capacity = 0;
+    unsigned long long first = 0;
+    size_t offset = magic;
+    while (offset + CAPTURE_HEADER_SIZE <= size) {
+        const unsigned char *h = data + offset;
+        size_t len = readLittle(h + 12, 2);
+        if (offset + CAPTURE_HEADER_SIZE + len > size || (h[14] & ~CAPTURE_TRUNCATED) > CAPTURE_CLOSE || h[15] > 2 ||
+            len >= sizeof(records->command)) {
+            break;
+        }
+        if (record_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            Record *grown = realloc(records, capacity * sizeof(Record));
+            if (grown == NULL) {
+                perror("malloc");
+                free(data);
+                return -1;
+            }
+            records = grown;
+        }
+        unsigned long long us = readLittle(h, 8);
+        if (record_count == 0 || us < first) {
+            first = us;
+        }
+        Record *r = &records[record_count];
+        r->t = us; // made relative below
+        r->connection = readLittle(h + 8, 4);
+        r->kind = h[14] & ~CAPTURE_TRUNCATED;
+        r->truncated = (h[14] & CAPTURE_TRUNCATED) != 0;
+        r->destination = h[15];
+        r->order = record_count++;
+        memcpy(r->command, h + CAPTURE_HEADER_SIZE, len);
+        r->command[len] = '\0';
+        // Conditional requests ("w24if <etag> <command>") are reported under the command
+        const char *command = r->command;
+        if (strncmp(command, "w24if ", 6) == 0 && strchr(command + 6, ' ') != NULL) {
+            command = strchr(command + 6, ' ') + 1;
+        }
+        int name_len = strncmp(command, "dirlist ", 8) == 0 ? 10 : (int)strcspn(command, " ");
+        snprintf(r->name, sizeof(r->name), "%.*s", name_len, command);
+        offset += CAPTURE_HEADER_SIZE + len;
+    }
+    if (offset != size) {
+        fprintf(stderr, "%s: ignoring %zu bytes after the last whole record\n", path, size - offset);
+    }
+    free(data);
+    for (size_t i = 0; i < record_count; i++) {
+        records[i].t = (records[i].t - first) / 1e6;
+    }
+    qsort(records, record_count, sizeof(Record), recordCompare);
+    return 0;
+}
+
+void listCapture(void) {
+    const char *kinds[] = {"accept", "command", "close"};
+    for (size_t i = 0; i < record_count; i++) {
+        const Record *r = &records[i];
+        printf("%12.6f %6u %-7s", r->t, r->connection, kinds[r->kind]);
+        if (r->kind == CAPTURE_COMMAND) {
+            printf(" %-9s %s%s", destination_names[r->destination], r->command, r->truncated ? " (truncated)" : "");
+        }
+        printf("\n");
+    }
+}
+
+Series *seriesFor(const char *name, const char *node) {
+    for (int i = 0; i < series_count; i++) {
+        if (strcmp(series[i].name, name) == 0 && strcmp(series[i].node, node) == 0) {
+            return &series[i];
+        }
+    }
+    if (series_count == MAX_KEYS) {
+        return NULL;
+    }
+    Series *s = &series[series_count++];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    snprintf(s->node, sizeof(s->node), "%s", node);
+    return s;
+}
+
+void record(const char *name, const char *node, double latency, long long bytes) {
+    Series *s = seriesFor(name, node);
+    if (s == NULL) {
+        return;
+    }
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 1024;
+        double *grown = realloc(s->latencies, capacity * sizeof(double));
+        if (grown == NULL) {
+            return;
+        }
+        s->latencies = grown;
+        s->capacity = capacity;
+    }
+    s->latencies[s->count++] = latency;
+    s->bytes += bytes;
+}
+
+int connOpen(Conn *c, const char *host, int port) {
+    struct sockaddr_in addr;
+    memset(c, 0, sizeof(*c));
+    strcpy(c->node, "?");
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd == -1) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr(host);
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    int nodelay = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    fcntl(c->fd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+size_t inFlight(const Conn *c) {
+    return c->tail - c->head;
+}
+
+// Queues a command on the connection; item is its mix entry or record, and due
+// is when it should have been sent
+int connIssue(Conn *c, const char *command, int item, double due) {
+    size_t len = strlen(command);
+    if (c->fd == -1) {
+        return -1;
+    }
+    if (c->out_len + len + 1 > c->out_capacity) {
+        size_t capacity = (c->out_len + len + 1) * 2;
+        char *grown = realloc(c->out, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        c->out = grown;
+        c->out_capacity = capacity;
+    }
+    if (inFlight(c) == c->capacity || c->tail == c->capacity) {
+        // Compact, then grow if still full
+        size_t n = inFlight(c);
+        if (c->head > 0) {
+            memmove(c->item, c->item + c->head, n * sizeof(int));
+            memmove(c->due, c->due + c->head, n * sizeof(double));
+            c->head = 0;
+            c->tail = n;
+        }
+        if (n == c->capacity) {
+            size_t capacity = c->capacity ? c->capacity * 2 : 64;
+            int *grown_item = realloc(c->item, capacity * sizeof(int));
+            double *grown_due = grown_item != NULL ? realloc(c->due, capacity * sizeof(double)) : NULL;
+            if (grown_item != NULL) {
+                c->item = grown_item;
+            }
+            if (grown_due == NULL) {
+                return -1;
+            }
+            c->due = grown_due;
+            c->capacity = capacity;
+        }
+    }
+    memcpy(c->out + c->out_len, command, len);
+    c->out[c->out_len + len] = '\n';
+    c->out_len += len + 1;
+    c->item[c->tail] = item;
+    c->due[c->tail++] = due;
+    return 0;
+}
+
+void connClose(Conn *c) {
+    if (c->fd == -1) {
+        return;
+    }
+    errors += inFlight(c);
+    c->head = c->tail;
+    close(c->fd);
+    c->fd = -1;
+}
+
+void connFlush(Conn *c) {
+    while (c->fd != -1 && c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                connClose(c);
+            }
+            return;
+        }
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+}
+
+// The reply to the oldest command in flight is complete
+void connComplete(Conn *c, double t) {
+    char node[32];
+    const char *field = strstr(c->header, " node=");
+    const char *id = strstr(c->header, " id=");
+    if (field != NULL) {
+        snprintf(node, sizeof(node), "%.*s", (int)strcspn(field + 6, " "), field + 6);
+    } else if (id != NULL) {
+        snprintf(node, sizeof(node), "%.*s", (int)strcspn(id + 4, ". "), id + 4);
+    } else {
+        snprintf(node, sizeof(node), "%s", c->node); // "ARCHIVE chunked" names no node
+    }
+    snprintf(c->node, sizeof(c->node), "%s", node);
+    if (inFlight(c) > 0 && records != NULL) {
+        const Record *r = &records[c->item[c->head]];
+        record(r->name, node, t - c->due[c->head], c->reply_bytes);
+        if (strcmp(node, "?") != 0 && strcmp(node, destination_names[r->destination]) != 0) {
+            rerouted++;
+        }
+        c->head++;
+    } else if (inFlight(c) > 0) {
+        record(mix[c->item[c->head]].name, node, t - c->due[c->head], c->reply_bytes);
+        c->head++;
+    }
+    c->state = READ_HEADER;
+}
+
+// Feeds received bytes through the reply parser
+void connReceive(Conn *c, const char *data, size_t len, double t) {
+    while (len > 0) {
+        if (c->state == READ_BODY || c->state == READ_CHUNK_BODY) {
+            size_t n = c->left < (long long)len ? (size_t)c->left : len;
+            data += n;
+            len -= n;
+            c->left -= n;
+            if (c->left == 0 && c->state == READ_BODY) {
+                connComplete(c, t);
+            } else if (c->left == 0) {
+                c->state = READ_CHUNK_LINE;
+            }
+            continue;
+        }
+        // Header and chunk length lines may arrive in pieces
+        const char *newline = memchr(data, '\n', len);
+        size_t n = newline != NULL ? (size_t)(newline - data) + 1 : len;
+        size_t copy = n < sizeof(c->line) - 1 - c->line_len ? n : sizeof(c->line) - 1 - c->line_len;
+        memcpy(c->line + c->line_len, data, copy);
+        c->line_len += copy;
+        c->line[c->line_len] = '\0';
+        data += n;
+        len -= n;
+        if (newline == NULL) {
+            continue;
+        }
+        c->line[strcspn(c->line, "\n")] = '\0';
+        c->line_len = 0;
+        long long length = 0;
+        if (c->state == READ_CHUNK_LINE) {
+            length = strtoll(c->line, NULL, 16);
+            c->state = length > 0 ? READ_CHUNK_BODY : READ_HEADER;
+            c->left = length;
+            c->reply_bytes += length;
+            if (length == 0) {
+                connComplete(c, t);
+            }
+            continue;
+        }
+        snprintf(c->header, sizeof(c->header), "%s", c->line);
+        c->reply_bytes = 0;
+        if (strncmp(c->header, "ARCHIVE chunked", 15) == 0) {
+            c->state = READ_CHUNK_LINE;
+        } else if (sscanf(c->header, "%*s %lld", &length) == 1 && length > 0) {
+            c->state = READ_BODY;
+            c->left = length;
+            c->reply_bytes = length;
+        } else {
+            connComplete(c, t); // UNCHANGED, or an empty reply
+        }
+    }
+}
+
+int latencyCompare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(const Series *s, double p) {
+    size_t index = (size_t)(p * (s->count - 1) + 0.5);
+    return s->latencies[index] * 1000;
+}
+
+void printSeries(const Series *s, double seconds) {
+    printf("%-12s %-10s %9zu %9.1f %9.3f %9.3f %9.3f %9.3f %9.2f\n", s->name, s->node, s->count, s->count / seconds,
+           percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999), s->latencies[s->count - 1] * 1000,
+           s->bytes / seconds / (1024 * 1024));
+}
+
+// Merges every series matching name (or node) into one, for the summary rows
+void printMerged(const char *label, const char *name, const char *node, double seconds) {
+    Series merged;
+    memset(&merged, 0, sizeof(merged));
+    snprintf(merged.name, sizeof(merged.name), "%s", label);
+    snprintf(merged.node, sizeof(merged.node), "%s", node != NULL ? node : "all");
+    for (int i = 0; i < series_count; i++) {
+        const Series *s = &series[i];
+        if ((name != NULL && strcmp(s->name, name) != 0) || (node != NULL && strcmp(s->node, node) != 0)) {
+            continue;
+        }
+        double *grown = realloc(merged.latencies, (merged.count + s->count) * sizeof(double));
+        if (grown == NULL) {
+            break;
+        }
+        merged.latencies = grown;
+        memcpy(merged.latencies + merged.count, s->latencies, s->count * sizeof(double));
+        merged.count += s->count;
+        merged.bytes += s->bytes;
+    }
+    if (merged.count > 0) {
+        qsort(merged.latencies, merged.count, sizeof(double), latencyCompare);
+        printSeries(&merged, seconds);
+    }
+    free(merged.latencies);
+}
+
+
+// Prints each name or node once, in the order the series first appeared
+void printSummary(int by_node, double seconds) {
+    for (int i = 0; i < series_count; i++) {
+        const char *key = by_node ? series[i].node : series[i].name;
+        int seen = 0;
+        for (int k = 0; k < i; k++) {
+            seen |= strcmp(by_node ? series[k].node : series[k].name, key) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+        if (by_node) {
+            printMerged("all", NULL, key, seconds);
+            continue;
+        }
+        for (int k = i; k < series_count; k++) {
+            if (strcmp(series[k].name, key) == 0) {
+                printSeries(&series[k], seconds);
+            }
+        }
+        printMerged(key, key, NULL, seconds);
+    }
+}
+
+// Sorts every series for the percentiles; returns the number of replies recorded
+long long sortSeries(void) {
+    long long completed = 0;
+    for (int i = 0; i < series_count; i++) {
+        qsort(series[i].latencies, series[i].count, sizeof(double), latencyCompare);
+        completed += series[i].count;
+    }
+    return completed;
+}
+
+// Per command with its per-node rows, then per node, then overall
+void printReport(double seconds) {
+    printf("%-12s %-10s %9s %9s %9s %9s %9s %9s %9s\n", "command", "node", "count", "req/s", "p50 ms", "p99 ms",
+           "p999 ms", "max ms", "MB/s");
+    printSummary(0, seconds);
+    printf("\n");
+    printSummary(1, seconds);
+    printMerged("all", NULL, NULL, seconds);
+    for (int i = 0; i < series_count; i++) {
+        free(series[i].latencies);
+    }
+}
+
+// Sends what is queued, closes connections whose captured counterpart ended
+// once their replies are in, and fills fds. Returns the number still open and
+// adds the commands in flight to *pending.
+int connsPrepare(Conn *conns, struct pollfd *fds, int count, size_t *pending) {
+    int live = 0;
+    for (int i = 0; i < count; i++) {
+        Conn *c = &conns[i];
+        connFlush(c);
+        if (c->closing && c->out_len == 0 && inFlight(c) == 0) {
+            connClose(c);
+        }
+        *pending += c->fd != -1 ? inFlight(c) : 0;
+        fds[i].fd = c->fd;
+        fds[i].events = POLLIN | (c->out_len > 0 ? POLLOUT : 0);
+        live += c->fd != -1;
+    }
+    return live;
+}
+
+// Waits up to timeout ms and feeds whatever arrived through the reply parsers
+int connsPoll(Conn *conns, struct pollfd *fds, int count, int timeout, char *buffer) {
+    if (poll(fds, count, timeout) == -1 && errno != EINTR) {
+        perror("poll");
+        return -1;
+    }
+    double t = now();
+    for (int i = 0; i < count; i++) {
+        if (fds[i].fd == -1 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        ssize_t n = recv(conns[i].fd, buffer, RECV_BUFFER_SIZE, 0);
+        if (n > 0) {
+            connReceive(&conns[i], buffer, n, t);
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            connClose(&conns[i]);
+        }
+    }
+    return 0;
+}
+
+void connsFree(Conn *conns, int count) {
+    for (int i = 0; i < count; i++) {
+        connClose(&conns[i]);
+        free(conns[i].out);
+        free(conns[i].item);
+        free(conns[i].due);
+    }
+    free(conns);
+}
+
+// Sends the mix over a fixed set of connections, closed or open loop
+int runMix(int connections, double duration, long long limit, double rate, const char *host, int port,
+           unsigned int seed) {
+    if (mix_count == 0) {
+        addMix(4, "dirlist -a");
+        addMix(2, "dirlist -t");
+        addMix(4, "w24fn sample.txt");
+        addMix(1, "w24fz 1 102400");
+        addMix(1, "w24ft txt");
+        addMix(1, "w24fda 2024-01-01");
+        addMix(1, "w24fdb 2024-01-01");
+    }
+    if (connections < 1) {
+        connections = 1;
+    }
+
+    Conn *conns = calloc(connections, sizeof(Conn));
+    struct pollfd *fds = calloc(connections, sizeof(struct pollfd));
+    char *buffer = malloc(RECV_BUFFER_SIZE);
+    if (conns == NULL || fds == NULL || buffer == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int open_count = 0;
+    for (int i = 0; i < connections; i++) {
+        if (connOpen(&conns[i], host, port) == 0) {
+            open_count++;
+        }
+    }
+    if (open_count == 0) {
+        fprintf(stderr, "Could not connect to %s:%d\n", host, port);
+        return 1;
+    }
+    printf("%d connections to %s:%d, %s", open_count, host, port, rate > 0 ? "open loop" : "closed loop");
+    if (rate > 0) {
+        printf(" at %.1f requests/s", rate);
+    }
+    printf(", %s\n\n", limit > 0 ? "request limit" : "timed");
+
+    double start = now();
+    double stop = start + duration;
+    double next_due = start;
+    double drain_until = 0;
+    long long issued = 0;
+    int rr = 0;
+    while (1) {
+        double t = now();
+        int issuing = (limit == 0 || issued < limit) && (limit > 0 || t < stop);
+        size_t pending = 0;
+        for (int i = 0; i < connections; i++) {
+            pending += conns[i].fd != -1 ? inFlight(&conns[i]) : 0;
+        }
+        if (!issuing && drain_until == 0) {
+            drain_until = t + DRAIN_SECONDS;
+        }
+        if (!issuing && (pending == 0 || t > drain_until)) {
+            break;
+        }
+        if (issuing && rate > 0) {
+            // Open loop: everything due by now goes out, whatever is still in flight
+            while (next_due <= t && (limit == 0 || issued < limit)) {
+                for (int tries = 0; tries < connections; tries++) {
+                    Conn *c = &conns[rr++ % connections];
+                    int m = pickMix(&seed);
+                    if (connIssue(c, mix[m].command, m, next_due) == 0) {
+                        issued++;
+                        break;
+                    }
+                }
+                next_due += 1 / rate;
+            }
+        } else if (issuing) {
+            for (int i = 0; i < connections && (limit == 0 || issued < limit); i++) {
+                int m = conns[i].fd != -1 && inFlight(&conns[i]) == 0 ? pickMix(&seed) : -1;
+                if (m != -1 && connIssue(&conns[i], mix[m].command, m, t) == 0) {
+                    issued++;
+                }
+            }
+        }
+        if (connsPrepare(conns, fds, connections, &pending) == 0) {
+            break;
+        }
+        int timeout = 100;
+        if (issuing && rate > 0) {
+            double wait = (next_due - now()) * 1000;
+            timeout = wait <= 0 ? 0 : wait < 100 ? (int)wait + 1 : 100;
+        }
+        if (connsPoll(conns, fds, connections, timeout, buffer) == -1) {
+            break;
+        }
+    }
+    double seconds = now() - start;
+    connsFree(conns, connections);
+
+    long long completed = sortSeries();
+    printf("%lld requests in %.3f s: %.1f requests/s, %lld failed\n\n", completed, seconds, completed / seconds,
+           errors);
+    printReport(seconds);
+    free(fds);
+    free(buffer);
+    return errors > 0 ? 1 : 0;
+}
+
+// Replays the loaded capture at speed times its captured pace (0: as fast as possible)
+int runReplay(double speed, const char *host, int port) {
+    // Captured connection numbers start over when serverw24 restarts, so each
+    // accept starts a new replay connection and later records use the newest
+    unsigned int max_connection = 0;
+    for (size_t i = 0; i < record_count; i++) {
+        if (records[i].connection > max_connection) {
+            max_connection = records[i].connection;
+        }
+    }
+    int *slot = malloc((max_connection + 1) * sizeof(int));
+    char *buffer = malloc(RECV_BUFFER_SIZE);
+    Conn *conns = NULL;
+    struct pollfd *fds = NULL;
+    int conn_count = 0, conn_capacity = 0;
+    if (slot == NULL || buffer == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (unsigned int i = 0; i <= max_connection; i++) {
+        slot[i] = -1;
+    }
+    double span = records[record_count - 1].t;
+    printf("%zu records over %.3f s, replayed to %s:%d ", record_count, span, host, port);
+    if (speed > 0) {
+        printf("at %.2fx\n\n", speed);
+    } else {
+        printf("as fast as possible\n\n");
+    }
+
+    double start = now();
+    double drain_until = 0;
+    size_t next = 0;
+    long long issued = 0, skipped = 0;
+    while (1) {
+        double t = now();
+        // Everything due by now happens, in captured order
+        for (; next < record_count && (speed <= 0 || start + records[next].t / speed <= t); next++) {
+            const Record *r = &records[next];
+            double due = speed > 0 ? start + r->t / speed : t;
+            if (r->kind == CAPTURE_CLOSE && slot[r->connection] == -1) {
+                // The connection was accepted before the capture started and sent nothing since
+                continue;
+            }
+            if (r->kind == CAPTURE_ACCEPT || (r->kind == CAPTURE_COMMAND && slot[r->connection] == -1)) {
+                // A command without an accept was captured from a connection already open
+                if (conn_count == conn_capacity) {
+                    conn_capacity = conn_capacity ? conn_capacity * 2 : 64;
+                    Conn *grown_conns = realloc(conns, conn_capacity * sizeof(Conn));
+                    struct pollfd *grown_fds =
+                        grown_conns != NULL ? realloc(fds, conn_capacity * sizeof(struct pollfd)) : NULL;
+                    if (grown_conns != NULL) {
+                        conns = grown_conns;
+                    }
+                    if (grown_fds == NULL) {
+                        perror("malloc");
+                        return 1;
+                    }
+                    fds = grown_fds;
+                }
+                if (connOpen(&conns[conn_count], host, port) == -1) {
+                    fprintf(stderr, "Could not connect to %s:%d: %s\n", host, port, strerror(errno));
+                }
+                slot[r->connection] = conn_count++;
+            }
+            Conn *c = &conns[slot[r->connection]];
+            if (r->kind == CAPTURE_COMMAND && (r->truncated || strncmp(r->command, "w24sync ", 8) == 0)) {
+                skipped++;
+            } else if (r->kind == CAPTURE_COMMAND && strcmp(r->command, "quitc") == 0) {
+                // quitc gets no reply; the client hangs up once the replies before it are in
+                c->closing = 1;
+            } else if (r->kind == CAPTURE_COMMAND) {
+                if (connIssue(c, r->command, (int)next, due) == 0) {
+                    issued++;
+                } else {
+                    errors++;
+                }
+            } else if (r->kind == CAPTURE_CLOSE) {
+                c->closing = 1;
+                slot[r->connection] = -1;
+            }
+        }
+        size_t pending = 0;
+        int live = connsPrepare(conns, fds, conn_count, &pending);
+        if (next == record_count && drain_until == 0) {
+            drain_until = t + DRAIN_SECONDS;
+        }
+        if (next == record_count && (pending == 0 || t > drain_until)) {
+            break;
+        }
+        int timeout = 100;
+        if (next < record_count && speed > 0) {
+            double wait = (start + records[next].t / speed - now()) * 1000;
+            timeout = wait <= 0 ? 0 : wait < 100 ? (int)wait + 1 : 100;
+        }
+        if (live == 0) {
+            if (next == record_count) {
+                break;
+            }
+            usleep(timeout * 1000);
+            continue;
+        }
+        if (connsPoll(conns, fds, conn_count, timeout, buffer) == -1) {
+            break;
+        }
+    }
+    double seconds = now() - start;
+    connsFree(conns, conn_count);
+
+    long long completed = sortSeries();
+    printf("%lld of %lld commands over %d connections in %.3f s: %.1f requests/s, %lld failed, %lld rerouted, "
+           "%lld skipped\n\n",
+           completed, issued, conn_count, seconds, completed / seconds, errors, rerouted, skipped);
+    printReport(seconds);
+    free(fds);
+    free(slot);
+    free(buffer);
+    free(records);
+    return errors > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int connections = 8;
+    double duration = 10;
+    long long limit = 0;
+    double rate = 0;
+    const char *host = SERVER_IP;
+    int port = PORT;
+    unsigned int seed = 1;
+    const char *capture = NULL;
+    double speed = 1;
+    int list = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:n:r:x:h:p:s:R:S:l")) != -1) {
+        switch (opt) {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'n':
+            limit = atoll(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'x': {
+            int consumed = 0;
+            int weight;
+            if (sscanf(optarg, "%d %n", &weight, &consumed) == 1 && consumed > 0) {
+                addMix(weight, optarg + consumed);
+            }
+            break;
+        }
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            seed = (unsigned int)atoi(optarg);
+            break;
+        case 'R':
+            capture = optarg;
+            break;
+        case 'S':
+            speed = atof(optarg);
+            break;
+        case 'l':
+            list = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-c connections] [-d seconds] [-n requests] [-r rate/s]\n"
+                    "          [-x \"<weight> <command>\"]... [-h host] [-p port] [-s seed]\n"
+                    "       %s -R <capture> [-S speed] [-l] [-h host] [-p port]\n",
+                    argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (capture == NULL) {
+        return runMix(connections, duration, limit, rate, host, port, seed);
+    }
+    if (loadCapture(capture) == -1) {
+        return 1;
+    }
+    if (list) {
+        listCapture();
+        return 0;
+    }
+    if (record_count == 0) {
+        fprintf(stderr, "%s holds no records\n", capture);
+        return 1;
+    }
+    return runReplay(speed, host, port);
+}
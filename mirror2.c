@@ -1,753 +1,3728 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <dirent.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <time.h>
-#include <stdbool.h>
- 
-#define PORT 8890
-#define MAXDATASIZE 1024
-#define PATH_MAX_LENGTH 512 // Adjust the size according to your needs
-#define TAR_COMMAND_FMT "tar -czf %s/temp.tar.gz -C %s %s"
-#define MAX_EXTENSIONS 3
-#define PERMISSIONS 0777
-#define BUFFER_SIZE 1024
-#define MAX_DIRS 100
-
-// Declare tar_fd as a global variable
-int tar_fd;
-
-// Structure to hold directory name and its creation time
-typedef struct {
-    char name[256];
-    time_t creation_time;
-} DirInfo;
-
-// Comparator function for sorting directories by creation time
-int creationTimecompare(const void *a, const void *b) {
-    const DirInfo *dir_info_a = (const DirInfo *)a;
-    const DirInfo *dir_info_b = (const DirInfo *)b;
-    return difftime(dir_info_a->creation_time, dir_info_b->creation_time);
-}
-
-// Comparator function for sorting directory names alphabetically
-int dirCompare(const void *a, const void *b) {
-    const char *dir_name_a = *(const char **)a;
-    const char *dir_name_b = *(const char **)b;
-    return strcmp(dir_name_a, dir_name_b);
-}
-
-int nameCompareODir(const struct dirent **d1, const struct dirent **d2) {
-    return strcmp((*d1)->d_name, (*d2)->d_name);
-}
-
-// Function to handle errors
-void manageerror(const char *msg) {
-    perror(msg);
-    exit(EXIT_FAILURE);
-}
-
-
-// Function prototypes
-
-int filecopying(const char *source_path, const char *destination_path);
-void performw24fz(int client_socket, long size1, long size2);
-void handle_w24fdb(int client_socket, char *date);
-void performw24fda(int client_socket, char *date);
-void performw24ft(int client_socket, char *extensions[], int ext_count);
-
-// Function prototypes
-void performdirlista(int client_socket);
-void performdirlistt(int client_socket);
-void performw24fn(int client_socket, char *filename);
-void manageRequest(int server_socket, int client_socket);
- 
-// Inside manageRequest function in mirror2 server
-void manageRequest(int server_socket, int client_socket) {
-
-        // Handle the client request
-        char buffer[MAXDATASIZE];
-        int num_bytes_recv;
-
-        while (1) {
-            // Receive command from client
-            num_bytes_recv = recv(client_socket, buffer, MAXDATASIZE, 0);
-            if (num_bytes_recv <= 0) {
-                break;
-            }
-            buffer[num_bytes_recv] = '\0';
-
-            // Inside manageRequest function
-            printf("Received command from client: %s\n", buffer);
-
-            // Handle the command
-            manage_command(client_socket, buffer);
-        }
-
-        // Close client socket in child process
-        close(client_socket);
-        //exit(EXIT_SUCCESS);
-    }
-
-
-// Function to handle client commands
-void manage_command(int client_socket, const char *command) {
-    // Check if the command is "w24fn"
-    if (strncmp(command, "w24fn", 5) == 0) {
-        // Extract filename from command
-        const char *filename = command + 6;
-        // Handle w24fn command
-        performw24fn(client_socket, filename);
-        return; // Exit function after handling w24fn command
-    } else if (strncmp(command, "w24fda", 6) == 0) {
-        // Extract date from command
-        const char *date_str = command + 6;
-        // Handle w24fda command
-        performw24fda(client_socket, date_str);
-        return; // Exit function after handling w24fda command
-    } else if (strncmp(command, "w24fz ", 6) == 0) {
-        // Extract size range from command
-        long size1, size2;
-        if (sscanf(command + 6, "%ld %ld", &size1, &size2) != 2) {
-            send(client_socket, "Invalid size range format", strlen("Invalid size range format"), 0);
-            return;
-        }
-        // Handle w24fz command
-        performw24fz(client_socket, size1, size2);
-        return; // Exit function after handling w24fz command
-    } else if (strncmp(command, "w24fdb", 6) == 0) {
-    const char *date_str = command + 7;
-    performw24fdb(client_socket, date_str);
-    return; // Exit function after handling w24fdb command
-}else if (strncmp(command, "w24ft", 5) == 0) {
-    // Adjust the command pointer to point to the extensions
-    command += 6; // Skip "w24ft "
-    
-    // Extract up to three extensions
-    char *extensions[3];
-    int ext_count = 0;
-    char *token = strtok(command, " ");
-    while (token != NULL && ext_count < 3) {
-        extensions[ext_count++] = token;
-        token = strtok(NULL, " ");
-    }
-    if (ext_count == 0) {
-        printf("[DEBUG] Invalid command\n");
-        close(client_socket);
-        return;
-    }
-    performw24ft(client_socket, extensions, ext_count);
-    printf("[DEBUG] w24ft function called\n");
-    return; // Exit function after handling w24ft command
-}
-
-
-
-    // Process other commands
-    if (strcmp(command, "dirlist -a") == 0) {
-        // Handle dirlist -a command
-        performdirlista(client_socket);
-    } else if (strcmp(command, "dirlist -t") == 0) {
-        // Handle dirlist -t command
-        performdirlistt(client_socket);
-    } else if (strcmp(command, "quitc") == 0) {
-        // Handle quitc command
-        return; // Exit function after handling quitc command
-    } else {
-        printf("Invalid commands");
-    }
-}
-
-
-
-void performdirlista(int client_socket) {
-    char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        perror("getenv");
-        exit(EXIT_FAILURE);
-    }
- 
-    struct dirent **namelist;
-    int n;
- 
-    // Scan the directory for subdirectories
-    n = scandir(home_dir, &namelist, NULL, alphasort);
-    if (n == -1) {
-        perror("scandir");
-        exit(EXIT_FAILURE);
-    }
- 
-    // Concatenate directory names into a single buffer
-    char response[MAXDATASIZE];
-    response[0] = '\0'; // Ensure the buffer is initially empty
-    for (int i = 0; i < n; i++) {
-        if (namelist[i]->d_type == DT_DIR) {
-            // Skip "." and ".." entries
-            if (strcmp(namelist[i]->d_name, ".") != 0 && strcmp(namelist[i]->d_name, "..") != 0) {
-                strcat(response, namelist[i]->d_name);
-                strcat(response, "\n");
-            }
-        }
-        free(namelist[i]);
-    }
-    free(namelist);
- 
-    // Send the concatenated buffer to the client
-    if (send(client_socket, response, strlen(response), 0) == -1) {
-        perror("send");
-        exit(EXIT_FAILURE);
-    }
- 
-    // Send a termination message to indicate the end of data
-    if (send(client_socket, "EndOfData\n", strlen("EndOfData\n"), 0) == -1) {
-        perror("send");
-        exit(EXIT_FAILURE);
-    }
-}
-
-// Function to handle dirlist -t command
-void performdirlistt(int client_socket) {
-    char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        perror("getenv");
-        exit(EXIT_FAILURE);
-    }
-
-    // Array to hold directory information
-    DirInfo dirs[MAX_DIRS];
-    int num_dirs = 0;
-
-    DIR *dir = opendir(home_dir); // Open home directory
-    if (!dir) {
-        perror("opendir");
-        return;
-    }
-
-    // Read directory entries
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && num_dirs < MAX_DIRS) {
-        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-            // Get directory information
-            struct stat statbuf;
-            char path[PATH_MAX];
-            snprintf(path, PATH_MAX, "%s/%s", home_dir, entry->d_name);
-            if (stat(path, &statbuf) == 0) {
-                strcpy(dirs[num_dirs].name, entry->d_name);
-                dirs[num_dirs].creation_time = statbuf.st_ctime;
-                num_dirs++;
-            }
-        }
-    }
-    closedir(dir);
-
-    // Sort directories by creation time
-    qsort(dirs, num_dirs, sizeof(DirInfo), creationTimecompare);
-
-    // Prepare the directory list as a single message
-    char directory_list[BUFFER_SIZE];
-    int offset = 0;
-    for (int i = 0; i < num_dirs; i++) {
-        int len = strlen(dirs[i].name);
-        memcpy(directory_list + offset, dirs[i].name, len);
-        offset += len;
-        directory_list[offset++] = '\n'; // Add newline separator
-    }
-    directory_list[offset] = '\0'; // Null-terminate the string
-
-    // Send the complete directory list to the client
-    if (send(client_socket, directory_list, strlen(directory_list), 0) == -1) {
-        perror("send");
-        return;
-    }
-}
-
-
-
-// Modify the performw24fn function to handle the w24fn command
-void performw24fn(int client_socket, char *filename) {
-    char path[PATH_MAX];
-    snprintf(path, PATH_MAX, "%s/%s", getenv("HOME"), filename);
-
-    // Open file
-    FILE *file = fopen(path, "r");
-    if (file != NULL) {
-        // Get file size
-        fseek(file, 0, SEEK_END);
-        long size = ftell(file);
-        fseek(file, 0, SEEK_SET);
-
-        // Get file permissions
-        struct stat file_stat;
-        stat(path, &file_stat);
-        char permissions[10];
-        snprintf(permissions, 10, "%o", file_stat.st_mode);
-
-        // Get file creation time
-        char created_time[20];
-        strftime(created_time, 20, "%Y-%m-%d %H:%M:%S", localtime(&file_stat.st_ctime));
-
-        // Send file information to client
-        char info[BUFFER_SIZE];
-        snprintf(info, BUFFER_SIZE, "%s Size: %ld bytes, Created: %s, Permissions: %s", filename, size, created_time, permissions);
-        if (send(client_socket, info, strlen(info), 0) == -1) {
-            perror("send");
-            exit(EXIT_FAILURE);
-        }
-
-        fclose(file);
-    } else {
-        // Send "File not found" message to client
-        if (send(client_socket, "File not found\n", 15, 0) == -1) {
-            perror("send");
-            exit(EXIT_FAILURE);
-        }
-    }
-}
-
-
-int filecopying(const char *source_path, const char *destination_path) {
-    FILE *source_file = fopen(source_path, "rb");
-    if (source_file == NULL) {
-        perror("Error opening source file");
-        return -1;
-    }
- 
-    FILE *destination_file = fopen(destination_path, "wb");
-    if (destination_file == NULL) {
-        perror("Error opening destination file");
-        fclose(source_file);
-        return -1;
-    }
- 
-    // Copy data from source file to destination file
-    char buffer[4096];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), source_file)) > 0) {
-        if (fwrite(buffer, 1, bytes_read, destination_file) != bytes_read) {
-            perror("Error writing to destination file");
-            fclose(source_file);
-            fclose(destination_file);
-            return -1;
-        }
-    }
- 
-    // Close files
-    fclose(source_file);
-    fclose(destination_file);
- 
-    return 0;
-}
-
-void performw24fz(int client_socket, long size1, long size2) {
-    const char *w24project_path = "./w24project";
-    //Create w24project directory if it doesn't exist
-    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
-    }
- 
-    printf("Handling w24fz command...\n");
- 
-    if (size1 < 0 || size2 < 0 || size1 > size2) {
-        // Invalid size range
-        printf("Invalid size range\n");
-        send(client_socket, "Invalid size range", strlen("Invalid size range"), 0);
-        return;
-    }
- 
-    char *home_dir = getenv("HOME");
-    if (home_dir == NULL) {
-        perror("getenv");
-        exit(EXIT_FAILURE);
-    }
- 
-    DIR *dir = opendir(home_dir);
-    if (dir == NULL) {
-        perror("opendir");
-        send(client_socket, "Error opening directory", strlen("Error opening directory"), 0);
-        return;
-    }
- 
-    printf("Home directory: %s\n", home_dir);
- 
-    // Create a temporary directory for storing files within the size range
-    char temp_dir[] = "./w24fz_temp";
-    if (mkdir(temp_dir, 0777) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        send(client_socket, "Error creating temporary directory", strlen("Error creating temporary directory"), 0);
-        closedir(dir);
-        return;
-    }
- 
-    printf("Temporary directory created: %s\n", temp_dir);
- 
-    // Flag to indicate if any files matching the size range were found
-    int files_found = 0;
- 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL) {
-        char path[PATH_MAX];
-        snprintf(path, PATH_MAX, "%s/%s", home_dir, entry->d_name);
- 
-        struct stat statbuf;
-        if (stat(path, &statbuf) == -1) {
-            perror("stat");
-            continue;
-        }
- 
-        if (S_ISREG(statbuf.st_mode) && statbuf.st_size >= size1 && statbuf.st_size <= size2) {
-            files_found = 1;
-            printf("Matching file found: %s\n", entry->d_name);
- 
-            // Copy the file to the temporary directory
-            char dest_path[PATH_MAX];
-            snprintf(dest_path, PATH_MAX, "%s/%s", temp_dir, entry->d_name);
-            if (filecopying(path, dest_path) == -1) {
-                perror("filecopying");
-                continue;
-            }
-            printf("File copied to temporary directory: %s\n", dest_path);
-        }
-    }
- 
-    closedir(dir);
- 
-    if (!files_found) {
-        // No files found in the specified size range
-        printf("No files found in the specified size range\n");
-        send(client_socket, "No file found", strlen("No file found"), 0);
-        return;
-    }
- 
-    // Create a tar file from the temporary directory
-    char tar_cmd[BUFFER_SIZE];
-    snprintf(tar_cmd, BUFFER_SIZE, "tar -czf w24project/temp.tar.gz -C %s .", temp_dir);
-    printf("Executing tar command: %s\n", tar_cmd);
- 
-    int status = system(tar_cmd);
-    if (status == -1) {
-        perror("system");
-        send(client_socket, "Error creating tar file", strlen("Error creating tar file"), 0);
-        return;
-    } else if (status != 0) {
-        fprintf(stderr, "Error creating tar file\n");
-        send(client_socket, "Error creating tar file", strlen("Error creating tar file"), 0);
-        return;
-    }
- 
-    printf("Tar command executed successfully.\n");
- 
-    // Send the path of the created tar file to the client
-    if (send(client_socket, "temp.tar.gz", strlen("temp.tar.gz"), 0) == -1) {
-        perror("send");
-        return;
-    }
-}
-
-void performw24fdb(int client_socket, char *date) {
-    const char *w24project_path = "./w24project";
-    const char *w24fdb_temp_path = "./w24project/w24fdb_temp";
-    const char *tar_file = "temp.tar.gz";
-    // Check if the date argument is provided
-    if (date == NULL) {
-        if (send(client_socket, "No date provided", strlen("No date provided"), 0) == -1) {
-            perror("send");
-            exit(EXIT_FAILURE);
-        }
-        return;
-    }
-    // Create w24project directory if it doesn't exist
-    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
-    }
- 
-    // Create w24fdb_temp directory inside w24project
-    if (mkdir(w24fdb_temp_path, PERMISSIONS) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
-    }
- 
-    printf("Directories created successfully.\n");
- 
-    // Construct the find command to search for files modified or created after the provided date
-    char find_cmd[BUFFER_SIZE];
-    snprintf(find_cmd, BUFFER_SIZE, "find ~ -type f -not -newermt \"%s\" -exec cp -n -t %s {} +", date, w24fdb_temp_path);
-    printf("Executing find command: %s\n", find_cmd); // Debugging statement
- 
-    // Execute the find command
-    int status = system(find_cmd);
-    if (status == -1) {
-        perror("system");
-        exit(EXIT_FAILURE);
-    } 
-    else if (status != 0) {
-    fprintf(stderr, "Error executing find command: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);}
- 
-else {
-    printf("Find command executed successfully.\n");
-}
- 
-struct stat st;
-    if (stat(tar_file, &st) == 0) {
-        // Tar file exists, delete it
-        if (remove(tar_file) == -1) {
-            perror("remove");
-            exit(EXIT_FAILURE);
-        }
-    }
-char tar_cmd[BUFFER_SIZE];
-    snprintf(tar_cmd, BUFFER_SIZE, "tar -czf w24project/temp.tar.gz -C %s .", w24fdb_temp_path);
-    printf("Executing tar command: %s\n", tar_cmd); // Debugging statement
- 
-    // Execute the tar command
-    status = system(tar_cmd);
-    if (status == -1) {
-        perror("system");
-        exit(EXIT_FAILURE);
-    } else if (status != 0) {
-        fprintf(stderr, "Error creating tar file\n");
-        exit(EXIT_FAILURE);
-    } else {
-        printf("Tar command executed successfully.\n");
-    }
- 
-    // Send the path of the created tar file to the client
-    if (send(client_socket, "temp.tar.gz", strlen("temp.tar.gz"), 0) == -1) {
-        perror("send");
-        exit(EXIT_FAILURE);
-    }
- 
- 
-}
-
-
-void performw24fda(int client_socket, char *date) {
-    const char *w24project_path = "./w24project";
-    const char *w24fda_temp_path = "./w24project/w24fda_temp";
-    const char *tar_file = "temp.tar.gz";
-    // Check if the date argument is provided
-    if (date == NULL) {
-        if (send(client_socket, "No date provided", strlen("No date provided"), 0) == -1) {
-            perror("send");
-            exit(EXIT_FAILURE);
-        }
-        return;
-    }
-   // Create w24project directory if it doesn't exist
-    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
-    }
-
-    // Create w24fdb_temp directory inside w24project
-    if (mkdir(w24fda_temp_path, PERMISSIONS) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Directories created successfully.\n");
-    
-    // Construct the find command to search for files modified or created after the provided date
-    char find_cmd[BUFFER_SIZE];
-    snprintf(find_cmd, BUFFER_SIZE, "find ~ -type f -newermt \"%s\" -exec cp -n -t %s {} +", date, w24fda_temp_path);
-    printf("Executing find command: %s\n", find_cmd); // Debugging statement
-
-    // Execute the find command
-    int status = system(find_cmd);
-    if (status == -1) {
-        perror("system");
-        exit(EXIT_FAILURE);
-    } 
-    else if (status != 0) {
-    fprintf(stderr, "Error executing find command: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);}
-
- else {
-    printf("Find command executed successfully.\n");
-}
-  char tar_cmd[BUFFER_SIZE];
-    snprintf(tar_cmd, BUFFER_SIZE, "tar -czf w24project/temp.tar.gz -C %s .", w24fda_temp_path);
-    printf("Executing tar command: %s\n", tar_cmd); // Debugging statement
-
-    // Execute the tar command
-    status = system(tar_cmd);
-    if (status == -1) {
-        perror("system");
-        exit(EXIT_FAILURE);
-    } else if (status != 0) {
-        fprintf(stderr, "Error creating tar file\n");
-        exit(EXIT_FAILURE);
-    } else {
-        printf("Tar command executed successfully.\n");
-    }
-
-    // Send the path of the created tar file to the client
-    if (send(client_socket, "temp.tar.gz", strlen("temp.tar.gz"), 0) == -1) {
-        perror("send");
-        exit(EXIT_FAILURE);
-    }
-
-}
-
-
-// Function to send and receive data
-void forwardAndReceive(int client_socket, const char *command) {
-    // Send command to server
-    if (send(client_socket, command, strlen(command), 0) < 0) {
-        manageerror("Error sending data to server");
-    }
-
-    if (strcmp(command, "quitc") != 0) {
-        char buffer[BUFFER_SIZE];
-        // Receive and print list of directories or file information from server
-        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received < 0) {
-            manageerror("Error receiving data from server");
-        } else if (bytes_received == 0) {
-            printf("Server closed connection\n");
-            exit(EXIT_SUCCESS);
-        }
-
-        buffer[bytes_received] = '\0';
-        printf("%s\n", buffer); // Print received data
-
-        // Check if the command is "w24fz" and create the w24project directory if it doesn't exist
-        if (strncmp(buffer, "w24fz", 5) == 0) {
-            system("mkdir -p ~/w24project");
-            printf("Temporary tar file created.\n");
-            // Move the temporary tar file to w24project directory
-            if (system("mv /tmp/w24fda_temp/temp.tar.gz ~/w24project/") == -1) {
-                manageerror("Error moving temp.tar.gz to w24project directory");
-            }
-        }
-    }
-}
-
-void performw24ft(int client_socket, char *extensions[], int ext_count) {
-   printf("Handling w24ft command...\n");
-   const char *w24project_path = "./w24project";
-    //Create w24project directory if it doesn't exist
-    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
-        perror("mkdir");
-        exit(EXIT_FAILURE);
-    }
-   // Check if the number of extensions is valid
-   if (ext_count < 1 || ext_count > 3) {
-       printf("Invalid number of extensions. Provide 1 to 3 extensions.\n");
-       send(client_socket, "Invalid number of extensions. Provide 1 to 3 extensions.", strlen("Invalid number of extensions. Provide 1 to 3 extensions."), 0);
-       return;
-   }
-   // Construct the find command to search for files matching the specified extensions
-   char find_command[BUFFER_SIZE];
-   snprintf(find_command, sizeof(find_command), "find ~ -type f \\( ");
-   for (int i = 0; i < ext_count; i++) {
-       snprintf(find_command + strlen(find_command), sizeof(find_command) - strlen(find_command), "-name \"*.%s\"", extensions[i]);
-       if (i < ext_count - 1) {
-           snprintf(find_command + strlen(find_command), sizeof(find_command) - strlen(find_command), " -o ");
-       }
-   }
-   strcat(find_command, " \\)");
-   printf("Find command: %s\n", find_command);
-   // Execute the find command
-   FILE *find_output = popen(find_command, "r");
-   if (!find_output) {
-       perror("Error executing find command");
-       send(client_socket, "Error executing find command", strlen("Error executing find command"), 0);
-       return;
-   }
-   // Create a temporary file list
-   char temp_file[] = "w24project/w24ft_temp_list.txt";
-   FILE *temp_file_ptr = fopen(temp_file, "w");
-   if (!temp_file_ptr) {
-       perror("Error creating temporary file list");
-       pclose(find_output);
-       return;
-   }
-   // Read the output of the find command and write each file path to the temporary file list
-   char file_path[BUFFER_SIZE];
-   while (fgets(file_path, sizeof(file_path), find_output) != NULL) {
-       fprintf(temp_file_ptr, "%s", file_path);
-   }
-   // Close the temporary file list
-   fclose(temp_file_ptr);
-   // Close the find command output
-   pclose(find_output);
-   // Create a tar archive from the files listed in the temporary file list
-   char tar_command[BUFFER_SIZE];
-    snprintf(tar_command, sizeof(tar_command), "tar -czf w24project/temp.tar.gz -C w24project -T w24project/w24ft_temp_list.txt");
-   printf("Tar command: %s\n", tar_command);
-   int ret = system(tar_command);
-   if (ret == -1) {
-       perror("Error creating tar archive");
-       send(client_socket, "Error creating tar archive", strlen("Error creating tar archive"), 0);
-   } else {
-       printf("Tar archive created successfully.\n");
-       send(client_socket, "Tar archive created successfully", strlen("Tar archive created successfully"), 0);
-   }
-   // Remove the temporary file list
-   remove(temp_file);
-}
-
-
-int main() {
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t sin_size;
- 
-    // Create socket
-    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
- 
-    // Server address setup
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    memset(&(server_addr.sin_zero), '\0', 8);
- 
-    // Bind socket
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
-    }
- 
-    // Listen for connections
-    if (listen(server_socket, 15) == -1) {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
-    }
- 
-    printf("Mirror2 is listening...\n");
- 
-    while (1) {
-        sin_size = sizeof(struct sockaddr_in);
-        if ((client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &sin_size)) == -1) {
-            perror("Accept failed");
-            continue;
-        }
- 
-        printf("Connection from %s has been established!\n", inet_ntoa(client_addr.sin_addr));
- 
-        // Handle client request
-        manageRequest(server_socket, client_socket);
-    }
- 
-    // Close server socket
-    close(server_socket);
- 
-    return 0;
-}
- 
-
-
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <math.h>
+#include <zlib.h>
+#include <ftw.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+// USDT probes (provider "w24") for attaching bpftrace or perf to a live node, e.g.
+//   bpftrace -e 'usdt:./serverw24:w24:scan_end { @entries[str(arg0)] = hist(arg1); }'
+// Each probe is a nop until a tracer attaches; without <sys/sdt.h>
+// (systemtap-sdt-dev) they compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifndef DTRACE_PROBE1
+#define DTRACE_PROBE1(provider, name, a1) ((void)0)
+#define DTRACE_PROBE2(provider, name, a1, a2) ((void)0)
+#define DTRACE_PROBE3(provider, name, a1, a2, a3) ((void)0)
+#endif
+ 
+#define PORT 8890
+#define MAXDATASIZE 1024
+#define PATH_MAX_LENGTH 512 // Adjust the size according to your needs
+#define TAR_COMMAND_FMT "tar -czf %s/temp.tar.gz -C %s %s"
+#define MAX_EXTENSIONS 3
+#define PERMISSIONS 0777
+#define BUFFER_SIZE 1024
+#define MAX_DIRS 100
+#define ARCHIVE_CHUNK_SIZE (256 * 1024) // read/deflate buffer size used by the archive writer
+#define ARCHIVE_LEVEL 6 // gzip level used for members that are worth compressing
+#define ENTROPY_SAMPLE_SIZE 4096 // bytes sampled when W24_ENTROPY_SAMPLE is set
+#define ENTROPY_STORE_THRESHOLD 7.5 // bits per byte above which a sample counts as incompressible
+#define NODE_NAME "mirror2" // names this node's work areas and its replies
+#define METRICS_PORT 9890 // local /metrics listener, see metricsStart
+#define WORK_DIR "w24project/work" // per-connection scratch areas live below here
+#define CACHE_DIR "w24project/cache" // finished archives, named by query fingerprint
+#define CACHE_MAX_BYTES (1024LL * 1024 * 1024) // default size bound, overridden by W24_CACHE_MAX_BYTES
+#define ARCHIVE_RETENTION_SECONDS 3600 // how long an unused archive stays fetchable, overridden by W24_ARCHIVE_RETENTION
+#define ARCHIVE_ID_SIZE 64 // "<node>.<32 hex digit cache key>" plus terminator
+#define STRIPE_MIN_BYTES (1024 * 1024) // archives smaller than this are sent whole by stripe 0
+#define DELTA_BLOCK_SIZE 4096 // block size reported for files the client does not have yet
+#define DELTA_MANIFEST_MAX (64LL * 1024 * 1024) // largest manifest accepted by w24sync
+#define HASH_INDEX_FILE "w24project/hashindex" // content hashes by inode and mtime, shared by all handlers
+#define HASH_INDEX_MAX_BYTES (64LL * 1024 * 1024) // the index is cleared when it grows past this
+#define PREFETCH_DEPTH 4 // files read ahead while archiving, overridden by W24_PREFETCH_DEPTH (0 turns it off)
+#define PREFETCH_MAX_BYTES (64LL * 1024 * 1024) // read-ahead advised per file
+#define COMMAND_BUFFER_SIZE (64 * 1024) // pipelined commands waiting to be handled
+
+// Declare tar_fd as a global variable
+int tar_fd;
+
+// Structure to hold directory name and its creation time
+typedef struct {
+    char name[256];
+    time_t creation_time;
+    struct stat st; // for binary records
+} DirInfo;
+
+// Comparator function for sorting directories by creation time
+int creationTimecompare(const void *a, const void *b) {
+    const DirInfo *dir_info_a = (const DirInfo *)a;
+    const DirInfo *dir_info_b = (const DirInfo *)b;
+    return difftime(dir_info_a->creation_time, dir_info_b->creation_time);
+}
+
+// Comparator function for sorting directory names alphabetically
+int dirCompare(const void *a, const void *b) {
+    const char *dir_name_a = *(const char **)a;
+    const char *dir_name_b = *(const char **)b;
+    return strcmp(dir_name_a, dir_name_b);
+}
+
+int nameCompareODir(const struct dirent **d1, const struct dirent **d2) {
+    return strcmp((*d1)->d_name, (*d2)->d_name);
+}
+
+// Function to handle errors
+void manageerror(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+// Directory tree the commands search: W24_ROOT if set, so scale tests can
+// point every node at a generated fixture, otherwise the home directory
+const char *rootDir(void) {
+    const char *root = getenv("W24_ROOT");
+    return root != NULL && *root != '\0' ? root : getenv("HOME");
+}
+
+
+// Function prototypes
+
+void send_response(int client_socket, const char *response);
+int metadataTag(const char *command, char tag[17]);
+int send_archive(int client_socket, int fd, const char *archive_path, long long offset, long long length);
+int send_file_range(int client_socket, int fd, off_t offset, off_t end);
+void performw24sync(int client_socket, long long manifest_len, const char *command);
+void archiveIdFromPath(const char *archive_path, char *id, size_t size);
+void performw24get(int client_socket, const char *id, long long offset, long long length);
+void performw24fz(int client_socket, long size1, long size2);
+void handle_w24fdb(int client_socket, char *date);
+void performw24fda(int client_socket, char *date);
+void performw24ft(int client_socket, char *extensions[], int ext_count);
+void performw24fq(int client_socket, char *args);
+
+// Function prototypes
+void performdirlista(int client_socket);
+void performdirlistt(int client_socket);
+void performw24fn(int client_socket, char *filename);
+void manageRequest(int server_socket, int client_socket);
+void traceSpan(const char *name, unsigned long long start, unsigned long long end);
+ 
+// Latency statistics, kept in memory shared by every handler this node forks.
+// Each command's time is recorded as a whole (total) and by stage, into
+// log-linear histograms: 8 linear buckets per power of two of nanoseconds,
+// so any value is placed within 12.5%. Recording is a clock read and a few
+// relaxed atomic adds, cheap enough to leave on.
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS (16 + 37 * STATS_SUB_BUCKETS) // exact below 16 ns, then up to 2^40 ns (about 18 minutes)
+
+enum { STAT_DIRLIST_A, STAT_DIRLIST_T, STAT_W24FN, STAT_W24FZ, STAT_W24FT, STAT_W24FDA, STAT_W24FDB, STAT_W24FQ,
+       STAT_W24GET, STAT_W24SYNC, STAT_W24STRIPE, STAT_W24IF, STAT_STATS, STAT_OTHER, STAT_COMMANDS };
+enum { STAGE_TOTAL, STAGE_PARSE, STAGE_SCAN, STAGE_FILTER, STAGE_ARCHIVE, STAGE_SEND, STAGE_MIRROR, STAT_STAGES };
+
+static const char *stat_command_names[STAT_COMMANDS] = {"dirlist -a", "dirlist -t", "w24fn",   "w24fz",
+                                                        "w24ft",      "w24fda",     "w24fdb",  "w24fq",
+                                                        "w24get",     "w24sync",    "w24stripe", "w24if",
+                                                        "stats",      "other"};
+static const char *stat_stage_names[STAT_STAGES] = {"total", "parse", "scan", "filter", "archive", "send", "mirror"};
+
+// Terms of a w24fq query; their pass rates are kept with the statistics
+enum { QUERY_NAME, QUERY_EXT, QUERY_SIZE, QUERY_AFTER, QUERY_BEFORE, QUERY_TERMS };
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[STATS_BUCKETS];
+} Histogram;
+
+typedef struct {
+    time_t started;
+    long long connections_active;
+    unsigned long long connections_total;
+    unsigned long long forks;
+    unsigned long long fork_failures;
+    unsigned long long bytes_sent;
+    unsigned long long archive_bytes; // archive and delta bodies, a subset of bytes_sent
+    unsigned long long log_dropped; // log buffers the logger had no room for
+    unsigned long long query_evaluated[QUERY_TERMS]; // files each w24fq term was tried on
+    unsigned long long query_passed[QUERY_TERMS]; // and let through
+    Histogram latency[STAT_COMMANDS][STAT_STAGES];
+} NodeStats;
+
+NodeStats *node_stats;
+int stats_command = STAT_OTHER; // the command this handler is serving
+unsigned long long stats_command_start; // when it was read
+int stats_parsed; // parse time recorded for it
+
+// Maps the shared counters; called once before the first fork
+void statsInit(void) {
+    node_stats = mmap(NULL, sizeof(NodeStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (node_stats == MAP_FAILED) {
+        perror("mmap stats");
+        node_stats = NULL;
+        return;
+    }
+    node_stats->started = time(NULL);
+}
+
+unsigned long long statsNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int statsBucket(unsigned long long ns) {
+    if (ns < 16) {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int bucket = 16 + (exponent - 4) * STATS_SUB_BUCKETS + (int)((ns >> (exponent - 3)) & (STATS_SUB_BUCKETS - 1));
+    return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Smallest value that falls in bucket
+unsigned long long statsBucketStart(int bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    int exponent = 4 + (bucket - 16) / STATS_SUB_BUCKETS;
+    return (unsigned long long)(STATS_SUB_BUCKETS + (bucket - 16) % STATS_SUB_BUCKETS) << (exponent - 3);
+}
+
+// Records the time since start against the current command and stage
+void statsRecord(int stage, unsigned long long start) {
+    if (node_stats == NULL) {
+        return;
+    }
+    unsigned long long end = statsNow(), ns = end - start;
+    traceSpan(stage == STAGE_TOTAL ? stat_command_names[stats_command] : stat_stage_names[stage], start, end);
+    Histogram *h = &node_stats->latency[stats_command][stage];
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->buckets[statsBucket(ns)], 1, __ATOMIC_RELAXED);
+    unsigned long long max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void statsSent(long long bytes) {
+    if (node_stats != NULL && bytes > 0) {
+        __atomic_fetch_add(&node_stats->bytes_sent, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+void statsArchiveSent(long long bytes) {
+    if (node_stats != NULL && bytes > 0) {
+        __atomic_fetch_add(&node_stats->archive_bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts a handler forked, or one that could not be
+void statsForked(int ok) {
+    if (node_stats != NULL) {
+        __atomic_fetch_add(ok ? &node_stats->forks : &node_stats->fork_failures, 1, __ATOMIC_RELAXED);
+    }
+}
+
+void statsConnectionClosed(void) {
+    __atomic_fetch_sub(&node_stats->connections_active, 1, __ATOMIC_RELAXED);
+}
+
+// Counts a handler's connection as active until the handler exits
+void statsConnectionOpened(void) {
+    if (node_stats != NULL) {
+        __atomic_fetch_add(&node_stats->connections_active, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&node_stats->connections_total, 1, __ATOMIC_RELAXED);
+        atexit(statsConnectionClosed);
+    }
+}
+
+// Classifies a command and starts its clock
+void statsBegin(const char *command) {
+    static const char *prefixes[STAT_OTHER] = {"dirlist -a", "dirlist -t", "w24fn",      "w24fz",  "w24ft",
+                                               "w24fda",     "w24fdb",     "w24fq ",     "w24get ", "w24sync ",
+                                               "w24stripe ", "w24if ",     "stats"};
+    stats_command = STAT_OTHER;
+    if (strncmp(command, "w24bin ", 7) == 0) {
+        command += 7; // binary replies count as the command itself
+    }
+    for (int i = 0; i < STAT_OTHER; i++) {
+        if (strncmp(command, prefixes[i], strlen(prefixes[i])) == 0) {
+            stats_command = i;
+            break;
+        }
+    }
+    stats_command_start = statsNow();
+    stats_parsed = 0;
+}
+
+// Value below which the given fraction of the histogram lies, in milliseconds
+double statsPercentile(const Histogram *h, unsigned long long count, double fraction) {
+    unsigned long long rank = (unsigned long long)(fraction * count), seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            // The middle of the bucket
+            return (statsBucketStart(b) + statsBucketStart(b + 1)) / 2.0 / 1e6;
+        }
+    }
+    return h->max_ns / 1e6;
+}
+
+// Replies to "stats" with this node's counters as JSON
+void performstats(int client_socket) {
+    size_t size = 4096 + STAT_COMMANDS * STAT_STAGES * 200;
+    char *json = malloc(size);
+    if (json == NULL || node_stats == NULL) {
+        send_response(client_socket, "{}");
+        free(json);
+        return;
+    }
+    size_t used = snprintf(json, size, "{\"node\":\"%s\",\"uptime_s\":%lld,\"bytes_sent\":%llu,\"commands\":{", NODE_NAME,
+                           (long long)(time(NULL) - node_stats->started),
+                           __atomic_load_n(&node_stats->bytes_sent, __ATOMIC_RELAXED));
+    const char *command_separator = "";
+    for (int c = 0; c < STAT_COMMANDS; c++) {
+        if (node_stats->latency[c][STAGE_TOTAL].count == 0 && node_stats->latency[c][STAGE_MIRROR].count == 0) {
+            continue;
+        }
+        used += snprintf(json + used, size - used, "%s\"%s\":{", command_separator, stat_command_names[c]);
+        command_separator = ",";
+        const char *stage_separator = "";
+        for (int s = 0; s < STAT_STAGES; s++) {
+            // Copy first; other handlers keep recording while this reads
+            Histogram h = node_stats->latency[c][s];
+            unsigned long long count = 0;
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                count += h.buckets[b];
+            }
+            if (count == 0) {
+                continue;
+            }
+            used += snprintf(json + used, size - used,
+                             "%s\"%s\":{\"count\":%llu,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,"
+                             "\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f}",
+                             stage_separator, stat_stage_names[s], count, h.sum_ns / 1e6 / count,
+                             statsPercentile(&h, count, 0.5), statsPercentile(&h, count, 0.9),
+                             statsPercentile(&h, count, 0.99), statsPercentile(&h, count, 0.999), h.max_ns / 1e6);
+            stage_separator = ",";
+        }
+        used += snprintf(json + used, size - used, "}");
+    }
+    snprintf(json + used, size - used, "}}");
+    send_response(client_socket, json);
+    free(json);
+}
+
+// Logging. Records are logfmt lines ("ts=... level=info node=... pid=...
+// msg=\"...\" key=value ..."). A handler collects them in its own buffer, and
+// the buffer is handed to a logger process through a non-blocking pipe at the
+// end of each command, or sooner when it fills. The logger process is the one
+// that writes to stdout. A slow terminal or pipe therefore never holds up a
+// handler; if the logger falls behind, records are dropped and counted.
+// W24_LOG_LEVEL picks error, warn, info (the default) or debug; records
+// below the level are not even formatted.
+#define LOG_BUFFER_SIZE PIPE_BUF // one atomic write to the pipe
+#define LOG_PIPE_SIZE (1024 * 1024) // records the logger may fall behind by
+
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+static const char *log_level_names[] = {"error", "warn", "info", "debug"};
+
+int log_level = LOG_INFO;
+int log_fd = STDOUT_FILENO; // the logger's pipe once it runs
+char log_buffer[LOG_BUFFER_SIZE];
+size_t log_used;
+
+#define logAt(level, ...)                                                                                              \
+    do {                                                                                                               \
+        if ((level) <= log_level) {                                                                                    \
+            logWrite((level), __VA_ARGS__);                                                                            \
+        }                                                                                                              \
+    } while (0)
+#define logError(...) logAt(LOG_ERROR, __VA_ARGS__)
+#define logWarn(...) logAt(LOG_WARN, __VA_ARGS__)
+#define logInfo(...) logAt(LOG_INFO, __VA_ARGS__)
+#define logDebug(...) logAt(LOG_DEBUG, __VA_ARGS__)
+
+// Hands the buffered records to the logger; called after each command and before forking
+void logFlush(void) {
+    if (log_used == 0) {
+        return;
+    }
+    if (write(log_fd, log_buffer, log_used) != (ssize_t)log_used && node_stats != NULL) {
+        __atomic_fetch_add(&node_stats->log_dropped, 1, __ATOMIC_RELAXED);
+    }
+    log_used = 0;
+}
+
+// Quotes a string value for a record; the result lasts for the next three calls too
+const char *logQuote(const char *s) {
+    static char buffers[4][512];
+    static int next;
+    char *out = buffers[next++ % 4];
+    size_t len = 0;
+    out[len++] = '"';
+    for (; *s != '\0' && len + 3 < sizeof(buffers[0]); s++) {
+        if (*s == '"' || *s == '\\') {
+            out[len++] = '\\';
+        }
+        out[len++] = (unsigned char)*s < ' ' ? ' ' : *s;
+    }
+    out[len++] = '"';
+    out[len] = '\0';
+    return out;
+}
+
+// Appends one record: msg, then fields, a printf format of " key=value" pairs
+// whose string values go through logQuote
+void logWrite(int level, const char *msg, const char *fields, ...) {
+    char record[1024];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int len = snprintf(record, sizeof(record), "ts=%lld.%03ld level=%s node=%s pid=%d msg=\"%s\"",
+                       (long long)ts.tv_sec, ts.tv_nsec / 1000000, log_level_names[level], NODE_NAME, getpid(), msg);
+    if (fields[0] != '\0' && len < (int)sizeof(record)) {
+        va_list args;
+        va_start(args, fields);
+        len += vsnprintf(record + len, sizeof(record) - len, fields, args);
+        va_end(args);
+    }
+    if (len >= (int)sizeof(record) - 1) {
+        len = sizeof(record) - 2; // cut off, but still one line
+    }
+    record[len++] = '\n';
+    if (log_used + len > sizeof(log_buffer)) {
+        logFlush();
+    }
+    memcpy(log_buffer + log_used, record, len);
+    log_used += len;
+    if (level <= LOG_WARN) {
+        logFlush();
+    }
+}
+
+// Reads W24_LOG_LEVEL and starts the logger process; called first thing in main
+void logInit(void) {
+    const char *level = getenv("W24_LOG_LEVEL");
+    for (int i = 0; level != NULL && i <= LOG_DEBUG; i++) {
+        if (strcmp(level, log_level_names[i]) == 0) {
+            log_level = i;
+        }
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        perror("log pipe");
+        return;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, LOG_PIPE_SIZE);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork logger");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        // Runs until every process holding the write end has exited
+        close(fds[1]);
+        char buffer[64 * 1024];
+        ssize_t n;
+        while ((n = read(fds[0], buffer, sizeof(buffer))) > 0 || (n == -1 && errno == EINTR)) {
+            for (ssize_t done = 0, w; done < n; done += w) {
+                if ((w = write(STDOUT_FILENO, buffer + done, n - done)) <= 0) {
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
+    close(fds[0]);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    log_fd = fds[1];
+    atexit(logFlush);
+}
+
+// Request tracing. With W24_TRACE=<file> every node appends Chrome trace
+// events (the JSON array format, which chrome://tracing and Perfetto load) to
+// that file: a complete event per stage of each command, tagged with its
+// request id. A client picks the id by sending "w24rid <id> <command>";
+// otherwise the node makes one up. serverw24 passes the id on when it relays,
+// so both halves of a relayed command carry the same one.
+#define TRACE_ID_SIZE 48
+
+int trace_fd = -1;
+pid_t trace_pid; // the node's main process, which viewers show as the process
+char trace_rid[TRACE_ID_SIZE]; // id of the command being served
+char trace_command[256]; // the command, escaped for JSON
+unsigned long long trace_accepted; // when this handler's connection was accepted
+
+// Opens the trace file; called once before the first fork
+void traceInit(void) {
+    const char *path = getenv("W24_TRACE");
+    if (path == NULL || path[0] == '\0') {
+        return;
+    }
+    // Whichever node creates the file opens the array; viewers do not need it closed
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+    if (fd != -1) {
+        write(fd, "[\n", 2);
+    } else if (errno == EEXIST) {
+        fd = open(path, O_WRONLY | O_APPEND);
+    }
+    if (fd == -1) {
+        perror("open trace");
+        return;
+    }
+    trace_fd = fd;
+    trace_pid = getpid();
+    char event[128];
+    int len = snprintf(event, sizeof(event), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                       trace_pid, NODE_NAME);
+    write(trace_fd, event, len);
+}
+
+// Takes the id off a "w24rid <id> <command>" prefix, leaving the command in place
+void traceBegin(char *command) {
+    trace_rid[0] = '\0';
+    char *end = strncmp(command, "w24rid ", 7) == 0 ? strchr(command + 7, ' ') : NULL;
+    if (end != NULL) {
+        size_t len = 0;
+        // The id goes into the trace unescaped, so keep it to a safe alphabet
+        for (const char *p = command + 7; p < end && len + 1 < sizeof(trace_rid); p++) {
+            trace_rid[len++] = isalnum((unsigned char)*p) || strchr("._-:", *p) != NULL ? *p : '_';
+        }
+        trace_rid[len] = '\0';
+        memmove(command, end + 1, strlen(end + 1) + 1);
+    }
+    if (trace_fd == -1) {
+        return;
+    }
+    if (trace_rid[0] == '\0') {
+        static unsigned int sequence;
+        snprintf(trace_rid, sizeof(trace_rid), "%s-%d-%u", NODE_NAME, getpid(), ++sequence);
+    }
+    size_t len = 0;
+    for (const char *p = command; *p != '\0' && len + 3 < sizeof(trace_command); p++) {
+        if (*p == '"' || *p == '\\') {
+            trace_command[len++] = '\\';
+        }
+        trace_command[len++] = (unsigned char)*p < ' ' ? ' ' : *p;
+    }
+    trace_command[len] = '\0';
+}
+
+// Writes one span of the current command; a single append, so handlers do not interleave
+void traceSpan(const char *name, unsigned long long start, unsigned long long end) {
+    if (trace_fd == -1) {
+        return;
+    }
+    char event[512];
+    int len = snprintf(event, sizeof(event),
+                       "{\"name\":\"%s\",\"cat\":\"w24\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                       "\"args\":{\"rid\":\"%s\",\"command\":\"%s\"}},\n",
+                       name, start / 1e3, (end - start) / 1e3, trace_pid, getpid(), trace_rid, trace_command);
+    if (len > 0 && (size_t)len < sizeof(event)) {
+        write(trace_fd, event, len);
+    }
+}
+
+// Inside manageRequest function in mirror2 server
+// Splits a connection's byte stream into commands. Clients that end each
+// command with '\n' may send several at once; a connection that has never
+// sent a '\n' is read one command per recv, as older clients send them bare.
+typedef struct {
+    int fd;
+    char buf[COMMAND_BUFFER_SIZE];
+    size_t used;
+    int line_mode;
+} CommandReader;
+
+// Copies the next command into command; returns 0 once the client disconnects
+int next_command(CommandReader *cr, char *command, size_t size) {
+    while (1) {
+        char *newline = memchr(cr->buf, '\n', cr->used);
+        size_t len = newline != NULL ? (size_t)(newline - cr->buf) : cr->used;
+        if (newline != NULL || (cr->used > 0 && !cr->line_mode)) {
+            cr->line_mode |= newline != NULL;
+            size_t copy = len < size - 1 ? len : size - 1;
+            memcpy(command, cr->buf, copy);
+            command[copy] = '\0';
+            size_t consumed = newline != NULL ? len + 1 : len;
+            memmove(cr->buf, cr->buf + consumed, cr->used - consumed);
+            cr->used -= consumed;
+            if (copy > 0) {
+                return 1;
+            }
+            continue; // blank line
+        }
+        if (cr->used == sizeof(cr->buf)) {
+            cr->used = 0; // a line longer than any command; drop it
+        }
+        ssize_t n = recv(cr->fd, cr->buf + cr->used, sizeof(cr->buf) - cr->used, 0);
+        if (n <= 0) {
+            return 0;
+        }
+        cr->used += n;
+    }
+}
+
+void manageRequest(int server_socket, int client_socket) {
+
+        // Handle the client request
+        char buffer[MAXDATASIZE];
+        static CommandReader reader;
+        reader.fd = client_socket;
+        unsigned long long handler_started = statsNow();
+
+        while (next_command(&reader, buffer, sizeof(buffer))) {
+
+            // Inside manageRequest function
+            traceBegin(buffer);
+            logInfo("command", " command=%s", logQuote(buffer));
+            statsBegin(buffer);
+            DTRACE_PROBE2(w24, command, buffer, stat_command_names[stats_command]);
+            if (trace_accepted != 0) {
+                // The first command on a connection also shows how long the handler took to start
+                traceSpan("accept", trace_accepted, handler_started);
+                trace_accepted = 0;
+            }
+
+            // Handle the command
+            manage_command(client_socket, buffer);
+            statsRecord(STAGE_TOTAL, stats_command_start);
+            logFlush();
+        }
+
+        // Close client socket in child process
+        close(client_socket);
+        //exit(EXIT_SUCCESS);
+    }
+
+
+// Set while serving "w24stripe <index> <count> <command>": only that share of
+// the archive is sent, so a client can fetch the shares from several nodes at once
+int stripe_index = 0;
+int stripe_count = 0;
+
+// Validator of the reply being sent, added to metadata replies as "etag=<tag>"
+char reply_tag[17];
+
+// Set when a w24if that missed has already computed reply_tag for its command
+int reply_tag_ready = 0;
+
+// Set while serving "w24bin <command>": metadata replies are sent as binary records
+int reply_records = 0;
+
+// Tags a metadata reply before it is built, so a change made meanwhile is caught
+// next time. Only dirlist and w24fn replies are tagged, and a tag left by w24if is reused.
+void tagReply(const char *command) {
+    if (!reply_tag_ready) {
+        metadataTag(command, reply_tag);
+    }
+    reply_tag_ready = 0;
+}
+
+// Function to handle client commands
+void manage_command(int client_socket, const char *command) {
+    // A tag belongs only to the reply it was computed for
+    if (!reply_tag_ready) {
+        reply_tag[0] = '\0';
+    }
+    if (!stats_parsed) {
+        statsRecord(STAGE_PARSE, stats_command_start);
+        stats_parsed = 1;
+    }
+    // Check if the command is "w24if": revalidate a reply the client has cached
+    if (strncmp(command, "w24if ", 6) == 0) {
+        char tag[17];
+        int consumed = 0;
+        if (sscanf(command + 6, "%16s %n", tag, &consumed) < 1 || consumed == 0) {
+            send_response(client_socket, "Invalid w24if format");
+            return;
+        }
+        int tagged = metadataTag(command + 6 + consumed, reply_tag) == 0;
+        if (tagged && strcmp(tag, reply_tag) == 0) {
+            char header[64];
+            int header_len = snprintf(header, sizeof(header), "UNCHANGED node=%s etag=%s\n", NODE_NAME, reply_tag);
+            if (send(client_socket, header, header_len, 0) == -1) {
+                perror("send");
+            }
+            statsSent(header_len);
+            return;
+        }
+        reply_tag_ready = tagged;
+        manage_command(client_socket, command + 6 + consumed);
+        reply_tag_ready = 0;
+        return;
+    }
+    // Check if the command is "stats"
+    if (strcmp(command, "stats") == 0 || strncmp(command, "stats ", 6) == 0) {
+        performstats(client_socket);
+        return;
+    }
+    // Check if the command is "w24sync"
+    if (strncmp(command, "w24sync ", 8) == 0) {
+        long long manifest_len;
+        int consumed = 0;
+        if (sscanf(command + 8, "%lld %n", &manifest_len, &consumed) < 1 || consumed == 0) {
+            send_response(client_socket, "Invalid w24sync format");
+            return;
+        }
+        performw24sync(client_socket, manifest_len, command + 8 + consumed);
+        return;
+    }
+    // Check if the command is "w24stripe"
+    if (strncmp(command, "w24stripe ", 10) == 0) {
+        int consumed = 0;
+        if (sscanf(command + 10, "%d %d %n", &stripe_index, &stripe_count, &consumed) < 2 || consumed == 0 ||
+            stripe_count < 1 || stripe_index < 0 || stripe_index >= stripe_count ||
+            strncmp(command + 10 + consumed, "w24f", 4) != 0) {
+            stripe_count = 0;
+            send_response(client_socket, "Invalid w24stripe format");
+            return;
+        }
+        manage_command(client_socket, command + 10 + consumed);
+        stripe_count = 0;
+        return;
+    }
+    // Check if the command is "w24bin"
+    if (strncmp(command, "w24bin ", 7) == 0) {
+        reply_records = 1;
+        manage_command(client_socket, command + 7);
+        reply_records = 0;
+        return;
+    }
+    // Check if the command is "w24fq"
+    if (strncmp(command, "w24fq ", 6) == 0) {
+        char args[MAXDATASIZE];
+        snprintf(args, sizeof(args), "%s", command + 6);
+        performw24fq(client_socket, args);
+        return;
+    }
+    // Check if the command is "w24get"
+    if (strncmp(command, "w24get ", 7) == 0) {
+        char id[ARCHIVE_ID_SIZE];
+        long long offset = 0, length = -1;
+        if (sscanf(command + 7, "%63s %lld %lld", id, &offset, &length) < 1) {
+            send_response(client_socket, "Invalid w24get format");
+            return;
+        }
+        performw24get(client_socket, id, offset, length);
+        return;
+    }
+    // Check if the command is "w24fn"
+    if (strncmp(command, "w24fn", 5) == 0) {
+        // Extract filename from command
+        const char *filename = command + 6;
+        // Handle w24fn command
+        tagReply(command);
+        performw24fn(client_socket, filename);
+        return; // Exit function after handling w24fn command
+    } else if (strncmp(command, "w24fda", 6) == 0) {
+        // Extract date from command
+        const char *date_str = command + 6;
+        // Handle w24fda command
+        performw24fda(client_socket, date_str);
+        return; // Exit function after handling w24fda command
+    } else if (strncmp(command, "w24fz ", 6) == 0) {
+        // Extract size range from command
+        long size1, size2;
+        if (sscanf(command + 6, "%ld %ld", &size1, &size2) != 2) {
+            send_response(client_socket, "Invalid size range format");
+            return;
+        }
+        // Handle w24fz command
+        performw24fz(client_socket, size1, size2);
+        return; // Exit function after handling w24fz command
+    } else if (strncmp(command, "w24fdb", 6) == 0) {
+    const char *date_str = command + 7;
+    performw24fdb(client_socket, date_str);
+    return; // Exit function after handling w24fdb command
+}else if (strncmp(command, "w24ft", 5) == 0) {
+    // Adjust the command pointer to point to the extensions
+    command += 6; // Skip "w24ft "
+    
+    // Extract up to three extensions
+    char *extensions[3];
+    int ext_count = 0;
+    char *token = strtok(command, " ");
+    while (token != NULL && ext_count < 3) {
+        extensions[ext_count++] = token;
+        token = strtok(NULL, " ");
+    }
+    if (ext_count == 0) {
+        logDebug("w24ft without extensions", "");
+        close(client_socket);
+        return;
+    }
+    performw24ft(client_socket, extensions, ext_count);
+    logDebug("w24ft handled", "");
+    return; // Exit function after handling w24ft command
+}
+
+
+
+    // Process other commands
+    if (strcmp(command, "dirlist -a") == 0) {
+        // Handle dirlist -a command
+        tagReply(command);
+        performdirlista(client_socket);
+    } else if (strcmp(command, "dirlist -t") == 0) {
+        // Handle dirlist -t command
+        tagReply(command);
+        performdirlistt(client_socket);
+    } else if (strcmp(command, "quitc") == 0) {
+        // Handle quitc command
+        return; // Exit function after handling quitc command
+    } else {
+        logWarn("invalid command", " command=%s", logQuote(command));
+        send_response(client_socket, "Invalid command");
+    }
+}
+
+
+
+// Sends a text reply framed as "TEXT <length> node=<node>\n" followed by the
+// text; metadata replies also carry their validator as "etag=<tag>"
+void send_response(int client_socket, const char *response) {
+    char header[96];
+    size_t len = strlen(response);
+    int header_len = reply_tag[0] != '\0'
+                         ? snprintf(header, sizeof(header), "TEXT %zu node=%s etag=%s\n", len, NODE_NAME, reply_tag)
+                         : snprintf(header, sizeof(header), "TEXT %zu node=%s\n", len, NODE_NAME);
+    unsigned long long start = statsNow();
+    if (send(client_socket, header, header_len, MSG_MORE) == -1 ||
+        send(client_socket, response, len, 0) == -1) {
+        perror("send");
+        exit(EXIT_FAILURE);
+    }
+    statsRecord(STAGE_SEND, start);
+    statsSent(header_len + len);
+    DTRACE_PROBE1(w24, send_done, header_len + len);
+}
+
+// Binary metadata replies. "w24bin <command>" gets dirlist -a, dirlist -t and
+// w24fn answered as "RECORDS <length> count=<n> node=<node> etag=<tag>\n"
+// followed by one record per entry, all fields little-endian: name length
+// (u16), name, size (u64), mtime and ctime (i64 seconds), mode (u32). The
+// node formats nothing and the client parses nothing; a w24fn miss is an
+// empty reply.
+#define RECORD_FIXED_SIZE 30 // bytes in a record besides the name
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    int count;
+} RecordBuffer;
+
+void putLittle(unsigned char *p, unsigned long long value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+int recordAppend(RecordBuffer *b, const char *name, const struct stat *sb) {
+    size_t name_len = strnlen(name, 0xffff);
+    if (b->len + RECORD_FIXED_SIZE + name_len > b->size) {
+        size_t size = (b->len + RECORD_FIXED_SIZE + name_len) * 2;
+        unsigned char *grown = realloc(b->data, size);
+        if (grown == NULL) {
+            return -1;
+        }
+        b->data = grown;
+        b->size = size;
+    }
+    unsigned char *p = b->data + b->len;
+    putLittle(p, name_len, 2);
+    memcpy(p + 2, name, name_len);
+    p += 2 + name_len;
+    putLittle(p, sb->st_size, 8);
+    putLittle(p + 8, sb->st_mtime, 8);
+    putLittle(p + 16, sb->st_ctime, 8);
+    putLittle(p + 24, sb->st_mode, 4);
+    b->len += RECORD_FIXED_SIZE + name_len;
+    b->count++;
+    return 0;
+}
+
+// Sends the records as a "RECORDS" reply and frees them
+void send_records(int client_socket, RecordBuffer *b) {
+    char header[128];
+    int header_len = reply_tag[0] != '\0' ? snprintf(header, sizeof(header), "RECORDS %zu count=%d node=%s etag=%s\n",
+                                                     b->len, b->count, NODE_NAME, reply_tag)
+                                          : snprintf(header, sizeof(header), "RECORDS %zu count=%d node=%s\n", b->len,
+                                                     b->count, NODE_NAME);
+    unsigned long long start = statsNow();
+    if (send(client_socket, header, header_len, b->len > 0 ? MSG_MORE : 0) == -1 ||
+        (b->len > 0 && send(client_socket, b->data, b->len, 0) == -1)) {
+        perror("send");
+        exit(EXIT_FAILURE);
+    }
+    statsRecord(STAGE_SEND, start);
+    statsSent(header_len + b->len);
+    DTRACE_PROBE1(w24, send_done, header_len + b->len);
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+// Sends bytes offset..end of fd with sendfile
+int send_file_range(int client_socket, int fd, off_t offset, off_t end) {
+    while (offset < end) {
+        ssize_t sent = sendfile(client_socket, fd, &offset, end - offset);
+        if (sent <= 0) {
+            if (sent == -1 && errno == EINTR) {
+                continue;
+            }
+            perror("sendfile");
+            return -1;
+        }
+        statsSent(sent);
+        statsArchiveSent(sent);
+    }
+    return 0;
+}
+
+// Sends length bytes of a finished archive starting at offset (length -1 means
+// to the end), framed as "ARCHIVE <length> id=<id> offset=<offset> total=<size>\n".
+// fd is the archive opened by the caller before any eviction could run, so an
+// entry unlinked from the cache in the meantime is still sent whole; it is closed
+// here. archive_path only names the archive id.
+int send_archive(int client_socket, int fd, const char *archive_path, long long offset, long long length) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    if (offset < 0 || offset > st.st_size) {
+        offset = st.st_size;
+    }
+    if (length < 0 || length > st.st_size - offset) {
+        length = st.st_size - offset;
+    }
+    char id[ARCHIVE_ID_SIZE];
+    archiveIdFromPath(archive_path, id, sizeof(id));
+    char header[160];
+    int header_len = snprintf(header, sizeof(header), "ARCHIVE %lld id=%s offset=%lld total=%lld\n",
+                              length, id, offset, (long long)st.st_size);
+    unsigned long long start = statsNow();
+    // MSG_MORE lets the header share a packet with the body; with no body it would sit corked
+    if (send(client_socket, header, header_len, length > 0 ? MSG_MORE : 0) == -1) {
+        perror("send");
+        close(fd);
+        return -1;
+    }
+    if (send_file_range(client_socket, fd, offset, offset + length) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    statsRecord(STAGE_SEND, start);
+    statsSent(header_len);
+    DTRACE_PROBE1(w24, send_done, header_len + length);
+    logInfo("sent archive", " id=%s offset=%lld end=%lld total=%lld", id, offset, offset + length, (long long)st.st_size);
+    return 0;
+}
+
+void performdirlista(int client_socket) {
+    const char *home_dir = rootDir();
+    if (home_dir == NULL) {
+        perror("getenv");
+        exit(EXIT_FAILURE);
+    }
+ 
+    struct dirent **namelist;
+    int n;
+ 
+    // Scan the directory for subdirectories
+    unsigned long long scan_start = statsNow();
+    DTRACE_PROBE1(w24, scan_start, home_dir);
+    n = scandir(home_dir, &namelist, NULL, alphasort);
+    statsRecord(STAGE_SCAN, scan_start);
+    DTRACE_PROBE2(w24, scan_end, home_dir, n);
+    if (n == -1) {
+        perror("scandir");
+        exit(EXIT_FAILURE);
+    }
+ 
+    // Concatenate directory names into a single buffer, or collect their records
+    char response[MAXDATASIZE];
+    response[0] = '\0'; // Ensure the buffer is initially empty
+    RecordBuffer records = {0};
+    for (int i = 0; i < n; i++) {
+        if (namelist[i]->d_type == DT_DIR) {
+            // Skip "." and ".." entries
+            if (strcmp(namelist[i]->d_name, ".") != 0 && strcmp(namelist[i]->d_name, "..") != 0) {
+                struct stat sb;
+                char dir_path[PATH_MAX];
+                if (!reply_records) {
+                    strcat(response, namelist[i]->d_name);
+                    strcat(response, "\n");
+                } else if (snprintf(dir_path, sizeof(dir_path), "%s/%s", home_dir, namelist[i]->d_name) <
+                               (int)sizeof(dir_path) &&
+                           stat(dir_path, &sb) == 0) {
+                    recordAppend(&records, namelist[i]->d_name, &sb);
+                }
+            }
+        }
+        free(namelist[i]);
+    }
+    free(namelist);
+ 
+    // Send the concatenated buffer to the client
+    if (reply_records) {
+        send_records(client_socket, &records);
+    } else {
+        send_response(client_socket, response);
+    }
+ 
+}
+
+// Function to handle dirlist -t command
+void performdirlistt(int client_socket) {
+    const char *home_dir = rootDir();
+    if (home_dir == NULL) {
+        perror("getenv");
+        exit(EXIT_FAILURE);
+    }
+
+    // Array to hold directory information
+    DirInfo dirs[MAX_DIRS];
+    int num_dirs = 0;
+
+    unsigned long long scan_start = statsNow();
+    DTRACE_PROBE1(w24, scan_start, home_dir);
+    DIR *dir = opendir(home_dir); // Open home directory
+    if (!dir) {
+        perror("opendir");
+        return;
+    }
+
+    // Read directory entries
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && num_dirs < MAX_DIRS) {
+        if (entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            // Get directory information
+            struct stat statbuf;
+            char path[PATH_MAX];
+            snprintf(path, PATH_MAX, "%s/%s", home_dir, entry->d_name);
+            if (stat(path, &statbuf) == 0) {
+                strcpy(dirs[num_dirs].name, entry->d_name);
+                dirs[num_dirs].creation_time = statbuf.st_ctime;
+                dirs[num_dirs].st = statbuf;
+                num_dirs++;
+            }
+        }
+    }
+    closedir(dir);
+    statsRecord(STAGE_SCAN, scan_start);
+    DTRACE_PROBE2(w24, scan_end, home_dir, num_dirs);
+
+    // Sort directories by creation time
+    qsort(dirs, num_dirs, sizeof(DirInfo), creationTimecompare);
+
+    if (reply_records) {
+        RecordBuffer records = {0};
+        for (int i = 0; i < num_dirs; i++) {
+            recordAppend(&records, dirs[i].name, &dirs[i].st);
+        }
+        send_records(client_socket, &records);
+        return;
+    }
+
+    // Prepare the directory list as a single message
+    char directory_list[BUFFER_SIZE];
+    int offset = 0;
+    for (int i = 0; i < num_dirs; i++) {
+        int len = strlen(dirs[i].name);
+        memcpy(directory_list + offset, dirs[i].name, len);
+        offset += len;
+        directory_list[offset++] = '\n'; // Add newline separator
+    }
+    directory_list[offset] = '\0'; // Null-terminate the string
+
+    // Send the complete directory list to the client
+    send_response(client_socket, directory_list);
+}
+
+
+
+// Modify the performw24fn function to handle the w24fn command
+void performw24fn(int client_socket, char *filename) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", rootDir(), filename);
+
+    // Open file
+    unsigned long long scan_start = statsNow();
+    DTRACE_PROBE1(w24, scan_start, path);
+    FILE *file = fopen(path, "r");
+    statsRecord(STAGE_SCAN, scan_start);
+    DTRACE_PROBE2(w24, scan_end, path, file != NULL);
+    if (file != NULL) {
+        // Get file size
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        // Get file permissions
+        struct stat file_stat;
+        stat(path, &file_stat);
+        if (reply_records) {
+            // One record, with nothing to format
+            RecordBuffer records = {0};
+            recordAppend(&records, filename, &file_stat);
+            send_records(client_socket, &records);
+            fclose(file);
+            return;
+        }
+        char permissions[10];
+        snprintf(permissions, 10, "%o", file_stat.st_mode);
+
+        // Get file creation time
+        char created_time[20];
+        strftime(created_time, 20, "%Y-%m-%d %H:%M:%S", localtime(&file_stat.st_ctime));
+
+        // Send file information to client
+        char info[BUFFER_SIZE];
+        snprintf(info, BUFFER_SIZE, "%s Size: %ld bytes, Created: %s, Permissions: %s", filename, size, created_time, permissions);
+        send_response(client_socket, info);
+
+        fclose(file);
+    } else if (reply_records) {
+        // No record: the file was not found
+        RecordBuffer records = {0};
+        send_records(client_socket, &records);
+    } else {
+        // Send "File not found" message to client
+        send_response(client_socket, "File not found\n");
+    }
+}
+
+
+
+// Gzip-framed tar writer. Every member (tar header + data) is deflated as its
+// own gzip stream, so already-compressed files can be stored instead of
+// recompressed while `tar -xzf` still reads the result as one archive.
+typedef struct {
+    int fd;
+    z_stream zs;
+    unsigned char *in;
+    unsigned char *out;
+    long long bytes_in;
+    long long bytes_out;
+    int members;
+    int stored_members;
+    int failed; // set once a write error has left the archive unusable
+    int chunked; // output goes to a socket as "<hex length>\n<bytes>" chunks
+} ArchiveWriter;
+
+// Extensions whose contents are already compressed
+static const char *incompressible_exts[] = {
+    "jpg", "jpeg", "png", "gif", "webp", "heic", "mp3", "mp4", "m4a", "m4v", "mkv",
+    "mov", "avi", "webm", "ogg", "flac", "gz", "tgz", "bz2", "xz", "zst", "lz4",
+    "zip", "7z", "rar", "jar", "docx", "xlsx", "pptx", "odt", NULL
+};
+
+// Returns 1 if the extension of path is known to be incompressible
+int extensionIncompressible(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return 0;
+    }
+    for (int i = 0; incompressible_exts[i] != NULL; i++) {
+        if (strcasecmp(dot + 1, incompressible_exts[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Estimates the Shannon entropy of the start of the file in bits per byte
+double sampleEntropy(int fd) {
+    unsigned char sample[ENTROPY_SAMPLE_SIZE];
+    ssize_t n = pread(fd, sample, sizeof(sample), 0);
+    if (n <= 0) {
+        return 0.0;
+    }
+    int counts[256] = {0};
+    for (ssize_t i = 0; i < n; i++) {
+        counts[sample[i]]++;
+    }
+    double entropy = 0.0;
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] > 0) {
+            double p = (double)counts[i] / n;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+// Decides whether a member should be stored rather than deflated
+int memberIncompressible(const char *path, int fd, off_t size) {
+    if (extensionIncompressible(path)) {
+        return 1;
+    }
+    if (getenv("W24_ENTROPY_SAMPLE") != NULL && size >= ENTROPY_SAMPLE_SIZE) {
+        return sampleEntropy(fd) >= ENTROPY_STORE_THRESHOLD;
+    }
+    return 0;
+}
+
+// Writes the whole buffer to fd, retrying on short writes
+int writeAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Prepares a writer that emits the archive to fd
+int archiveInit(ArchiveWriter *aw, int fd) {
+    memset(aw, 0, sizeof(*aw));
+    aw->fd = fd;
+    aw->in = malloc(ARCHIVE_CHUNK_SIZE);
+    aw->out = malloc(ARCHIVE_CHUNK_SIZE);
+    // windowBits 15 + 16 selects the gzip wrapper
+    if (aw->in == NULL || aw->out == NULL ||
+        deflateInit2(&aw->zs, ARCHIVE_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Error initialising archive writer\n");
+        free(aw->in);
+        free(aw->out);
+        return -1;
+    }
+    return 0;
+}
+
+int archiveOpen(ArchiveWriter *aw, const char *archive_path) {
+    int fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open archive");
+        return -1;
+    }
+    if (archiveInit(aw, fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Streams the archive to a socket in chunks, for when its size is not known up front
+int archiveOpenStream(ArchiveWriter *aw, int socket_fd) {
+    if (archiveInit(aw, socket_fd) == -1) {
+        return -1;
+    }
+    aw->chunked = 1;
+    return 0;
+}
+
+// Writes compressed output, adding chunk framing when streaming
+int archiveEmit(ArchiveWriter *aw, const void *data, size_t len) {
+    if (aw->chunked) {
+        char chunk_header[32];
+        int header_len = snprintf(chunk_header, sizeof(chunk_header), "%zx\n", len);
+        if (writeAll(aw->fd, chunk_header, header_len) == -1) {
+            return -1;
+        }
+        statsSent(header_len + len);
+        statsArchiveSent(len);
+    }
+    return writeAll(aw->fd, data, len);
+}
+
+// Feeds len bytes into the current gzip member, finishing it when flush is Z_FINISH
+int archiveDeflate(ArchiveWriter *aw, const unsigned char *data, size_t len, int flush) {
+    aw->zs.next_in = (unsigned char *)data;
+    aw->zs.avail_in = len;
+    aw->bytes_in += len;
+    int ret;
+    do {
+        aw->zs.next_out = aw->out;
+        aw->zs.avail_out = ARCHIVE_CHUNK_SIZE;
+        ret = deflate(&aw->zs, flush);
+        if (ret == Z_STREAM_ERROR) {
+            aw->failed = 1;
+            return -1;
+        }
+        size_t have = ARCHIVE_CHUNK_SIZE - aw->zs.avail_out;
+        if (have > 0 && archiveEmit(aw, aw->out, have) == -1) {
+            perror("write archive");
+            aw->failed = 1;
+            return -1;
+        }
+        aw->bytes_out += have;
+    } while (aw->zs.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    return 0;
+}
+
+// Starts a new gzip member at the given compression level
+int archiveBeginMember(ArchiveWriter *aw, int level) {
+    if (deflateReset(&aw->zs) != Z_OK || deflateParams(&aw->zs, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        aw->failed = 1;
+        return -1;
+    }
+    aw->members++;
+    if (level == Z_NO_COMPRESSION) {
+        aw->stored_members++;
+    }
+    return 0;
+}
+
+// Stores value as a NUL-terminated octal field, or base-256 when it does not fit
+void tarNumber(char *field, int width, unsigned long long value) {
+    if (width == 12 && value > 077777777777ULL) {
+        memset(field, 0, width);
+        field[0] = (char)0x80;
+        for (int i = width - 1; i > 0 && value > 0; i--) {
+            field[i] = (char)(value & 0xff);
+            value >>= 8;
+        }
+        return;
+    }
+    snprintf(field, width, "%0*llo", width - 1, value);
+}
+
+// Fills a ustar header block; returns -1 if name needs a GNU long-name entry
+int tarHeader(unsigned char block[512], const char *name, const struct stat *st, char typeflag, const char *linkname) {
+    memset(block, 0, 512);
+    size_t len = strlen(name);
+    int fits = 1;
+    if (len <= 100) {
+        memcpy(block, name, len);
+    } else {
+        // Split into prefix/name at a '/' so that both halves fit
+        const char *split = NULL;
+        for (const char *p = name + len - 1; p > name; p--) {
+            if (*p == '/' && (size_t)(name + len - p - 1) <= 100 && (size_t)(p - name) <= 155) {
+                split = p;
+                break;
+            }
+        }
+        if (split != NULL) {
+            memcpy(block, split + 1, name + len - split - 1);
+            memcpy(block + 345, name, split - name);
+        } else {
+            memcpy(block, name, 100);
+            fits = 0;
+        }
+    }
+    tarNumber((char *)block + 100, 8, st->st_mode & 07777);
+    tarNumber((char *)block + 108, 8, st->st_uid);
+    tarNumber((char *)block + 116, 8, st->st_gid);
+    tarNumber((char *)block + 124, 12, typeflag == '0' ? (unsigned long long)st->st_size : 0);
+    tarNumber((char *)block + 136, 12, st->st_mtime);
+    block[156] = typeflag;
+    if (linkname != NULL) {
+        strncpy((char *)block + 157, linkname, 100);
+    }
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    // The checksum is computed with the checksum field set to spaces
+    memset(block + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += block[i];
+    }
+    snprintf((char *)block + 148, 8, "%06o", sum);
+    return fits ? 0 : -1;
+}
+
+// Emits a GNU long-name entry carrying name into the current member: type 'L'
+// for the member name, 'K' for the target of a link. A member is under way, so
+// any failure leaves the stream unusable and sets aw->failed.
+int tarLongName(ArchiveWriter *aw, const char *name, char type) {
+    unsigned char block[512];
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_size = strlen(name) + 1;
+    tarHeader(block, "././@LongLink", &st, '0', NULL);
+    block[156] = type;
+    memset(block + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < 512; i++) {
+        sum += block[i];
+    }
+    snprintf((char *)block + 148, 8, "%06o", sum);
+    if (archiveDeflate(aw, block, 512, Z_NO_FLUSH) == -1) {
+        return -1;
+    }
+    size_t padded = (st.st_size + 511) / 512 * 512;
+    unsigned char *data = calloc(1, padded);
+    if (data == NULL) {
+        aw->failed = 1;
+        return -1;
+    }
+    memcpy(data, name, st.st_size);
+    int ret = archiveDeflate(aw, data, padded, Z_NO_FLUSH);
+    free(data);
+    return ret;
+}
+
+// Adds a hard link entry (type '1') naming an earlier member with the same content.
+// Returns -1 with aw->failed clear only if nothing was written, so the caller
+// may still archive the file in full.
+int archiveAddLink(ArchiveWriter *aw, const char *path, const char *member_name, const char *target_name) {
+    struct stat st;
+    if (stat(path, &st) == -1 || archiveBeginMember(aw, ARCHIVE_LEVEL) == -1) {
+        return -1;
+    }
+    // From here on a failure leaves a partial member behind
+    unsigned char header[512];
+    if ((strlen(target_name) > 100 && tarLongName(aw, target_name, 'K') == -1) ||
+        (tarHeader(header, member_name, &st, '1', target_name) == -1 && tarLongName(aw, member_name, 'L') == -1) ||
+        archiveDeflate(aw, header, sizeof(header), Z_NO_FLUSH) == -1 || archiveDeflate(aw, NULL, 0, Z_FINISH) == -1) {
+        aw->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Appends the regular file at path to the archive under member_name.
+// Unreadable files are skipped (-1); write errors also set aw->failed.
+int archiveAddFile(ArchiveWriter *aw, const char *path, const char *member_name) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open member");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    DTRACE_PROBE2(w24, member_start, member_name, st.st_size);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    int level = memberIncompressible(member_name, fd, st.st_size) ? Z_NO_COMPRESSION : ARCHIVE_LEVEL;
+    if (archiveBeginMember(aw, level) == -1) {
+        close(fd);
+        return -1;
+    }
+    // From here on a failure leaves a partial member behind, so it fails the archive
+    unsigned char header[512];
+    if ((tarHeader(header, member_name, &st, '0', NULL) == -1 && tarLongName(aw, member_name, 'L') == -1) ||
+        archiveDeflate(aw, header, sizeof(header), Z_NO_FLUSH) == -1) {
+        aw->failed = 1;
+        close(fd);
+        return -1;
+    }
+    // Copy exactly st_size bytes so the header stays valid if the file grows
+    off_t remaining = st.st_size;
+    while (remaining > 0) {
+        size_t want = remaining < ARCHIVE_CHUNK_SIZE ? (size_t)remaining : ARCHIVE_CHUNK_SIZE;
+        ssize_t n = read(fd, aw->in, want);
+        if (n <= 0) {
+            // File shrank underneath us; pad with zeros to keep the stream consistent
+            memset(aw->in, 0, want);
+            n = want;
+        }
+        if (archiveDeflate(aw, aw->in, n, Z_NO_FLUSH) == -1) {
+            aw->failed = 1;
+            close(fd);
+            return -1;
+        }
+        remaining -= n;
+    }
+    // Done with these pages; dropping them keeps big archives from flushing the page cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    size_t pad = (512 - st.st_size % 512) % 512;
+    if (pad > 0) {
+        memset(aw->in, 0, pad);
+        if (archiveDeflate(aw, aw->in, pad, Z_NO_FLUSH) == -1) {
+            aw->failed = 1;
+            return -1;
+        }
+    }
+    int ret = archiveDeflate(aw, NULL, 0, Z_FINISH);
+    if (ret == -1) {
+        aw->failed = 1;
+    }
+    // Compressed output so far, including this member
+    DTRACE_PROBE3(w24, member_end, member_name, st.st_size, aw->bytes_out);
+    return ret;
+}
+
+// Writes the end-of-archive marker and releases the writer
+int archiveClose(ArchiveWriter *aw) {
+    int ret = aw->failed ? -1 : 0;
+    unsigned char trailer[1024];
+    memset(trailer, 0, sizeof(trailer));
+    if (archiveBeginMember(aw, ARCHIVE_LEVEL) == -1 ||
+        archiveDeflate(aw, trailer, sizeof(trailer), Z_FINISH) == -1) {
+        ret = -1;
+    }
+    aw->members--; // the trailer is not a member
+    deflateEnd(&aw->zs);
+    free(aw->in);
+    free(aw->out);
+    if (aw->chunked) {
+        // A zero-length chunk ends the stream; the socket stays open
+        if (ret == 0 && writeAll(aw->fd, "0\n", 2) == -1) {
+            ret = -1;
+        }
+    } else if (close(aw->fd) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+// Private scratch directory of this connection handler, created on first use
+char work_area[PATH_MAX] = "";
+
+int removeTreeEntry(const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    (void)typeflag;
+    (void)ftwbuf;
+    return remove(path);
+}
+
+// Deletes the work area and everything left in it
+void removeWorkArea(void) {
+    if (work_area[0] != '\0') {
+        nftw(work_area, removeTreeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        work_area[0] = '\0';
+    }
+}
+
+// Returns this handler's work area, creating it on first use.
+// The area is removed when the handler exits, including after a disconnect.
+const char *workArea(void) {
+    static int cleanup_registered = 0;
+    if (work_area[0] != '\0') {
+        return work_area;
+    }
+    if ((mkdir("w24project", PERMISSIONS) == -1 && errno != EEXIST) ||
+        (mkdir(WORK_DIR, PERMISSIONS) == -1 && errno != EEXIST)) {
+        perror("mkdir");
+        return NULL;
+    }
+    snprintf(work_area, sizeof(work_area), "%s/%s-%d", WORK_DIR, NODE_NAME, getpid());
+    // A leftover with our pid belongs to a dead handler whose pid was reused
+    removeWorkArea();
+    snprintf(work_area, sizeof(work_area), "%s/%s-%d", WORK_DIR, NODE_NAME, getpid());
+    if (mkdir(work_area, 0700) == -1) {
+        perror("mkdir work area");
+        work_area[0] = '\0';
+        return NULL;
+    }
+    if (!cleanup_registered) {
+        atexit(removeWorkArea);
+        cleanup_registered = 1;
+    }
+    return work_area;
+}
+
+// Removes work areas of this node whose handler died without cleaning up
+void sweepStaleWorkAreas(void) {
+    DIR *dir = opendir(WORK_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    size_t prefix_len = strlen(NODE_NAME);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, NODE_NAME, prefix_len) != 0 || entry->d_name[prefix_len] != '-') {
+            continue;
+        }
+        pid_t pid = atoi(entry->d_name + prefix_len + 1);
+        if (pid > 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+            snprintf(work_area, sizeof(work_area), "%s/%s", WORK_DIR, entry->d_name);
+            logInfo("removing stale work area", " path=%s", logQuote(work_area));
+            removeWorkArea();
+        }
+    }
+    closedir(dir);
+}
+
+// Streaming XXH64, used to fingerprint archive queries
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef struct {
+    unsigned long long v[4];
+    unsigned long long total_len;
+    unsigned long long seed;
+    unsigned char mem[32];
+    size_t memsize;
+} Xxh64State;
+
+static unsigned long long xxhRotl(unsigned long long x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long xxhRead64(const unsigned char *p) {
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned long long xxhRound(unsigned long long acc, unsigned long long input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxhRotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static unsigned long long xxhMergeRound(unsigned long long acc, unsigned long long val) {
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxh64Init(Xxh64State *st, unsigned long long seed) {
+    memset(st, 0, sizeof(*st));
+    st->seed = seed;
+    st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    st->v[1] = seed + XXH_PRIME64_2;
+    st->v[2] = seed;
+    st->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxh64Update(Xxh64State *st, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    st->total_len += len;
+    if (st->memsize + len < 32) {
+        memcpy(st->mem + st->memsize, p, len);
+        st->memsize += len;
+        return;
+    }
+    if (st->memsize > 0) {
+        size_t fill = 32 - st->memsize;
+        memcpy(st->mem + st->memsize, p, fill);
+        for (int i = 0; i < 4; i++) {
+            st->v[i] = xxhRound(st->v[i], xxhRead64(st->mem + i * 8));
+        }
+        p += fill;
+        st->memsize = 0;
+    }
+    while (p + 32 <= end) {
+        for (int i = 0; i < 4; i++) {
+            st->v[i] = xxhRound(st->v[i], xxhRead64(p + i * 8));
+        }
+        p += 32;
+    }
+    if (p < end) {
+        memcpy(st->mem, p, end - p);
+        st->memsize = end - p;
+    }
+}
+
+unsigned long long xxh64Digest(const Xxh64State *st) {
+    unsigned long long h;
+    if (st->total_len >= 32) {
+        h = xxhRotl(st->v[0], 1) + xxhRotl(st->v[1], 7) + xxhRotl(st->v[2], 12) + xxhRotl(st->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxhMergeRound(h, st->v[i]);
+        }
+    } else {
+        h = st->seed + XXH_PRIME64_5;
+    }
+    h += st->total_len;
+    const unsigned char *p = st->mem;
+    const unsigned char *end = p + st->memsize;
+    while (p + 8 <= end) {
+        h ^= xxhRound(0, xxhRead64(p));
+        h = xxhRotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        unsigned int k;
+        memcpy(&k, p, sizeof(k));
+        h ^= (unsigned long long)k * XXH_PRIME64_1;
+        h = xxhRotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * XXH_PRIME64_5;
+        h = xxhRotl(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Validator for the metadata replies (dirlist -a, dirlist -t, w24fn): a hash
+// of the stat fields each reply is built from. It changes whenever the reply
+// would, so a client holding a copy with the same tag can be told "unchanged"
+// without the listing being rebuilt or resent. Writes 16 hex digits to tag,
+// or returns -1 with tag empty for any other command.
+void metadataStat(Xxh64State *st, const struct stat *sb) {
+    long long fields[8] = {(long long)sb->st_dev, (long long)sb->st_ino, sb->st_size, sb->st_mode,
+                           sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec, sb->st_ctim.tv_sec, sb->st_ctim.tv_nsec};
+    xxh64Update(st, fields, sizeof(fields));
+}
+
+int metadataTag(const char *command, char tag[17]) {
+    const char *home_dir = rootDir();
+    struct stat sb;
+    Xxh64State st;
+    tag[0] = '\0';
+    if (home_dir == NULL) {
+        return -1;
+    }
+    xxh64Init(&st, 0);
+    // Records and text of the same listing get different tags
+    int records = reply_records;
+    if (strncmp(command, "w24bin ", 7) == 0) {
+        command += 7;
+        records = 1;
+    }
+    xxh64Update(&st, command, strlen(command));
+    xxh64Update(&st, &records, sizeof(records));
+    if (strcmp(command, "dirlist -a") == 0 || strcmp(command, "dirlist -t") == 0) {
+        // Adding, removing or renaming a subdirectory updates the home directory's mtime
+        if (stat(home_dir, &sb) == -1) {
+            return -1;
+        }
+        metadataStat(&st, &sb);
+        // dirlist -t also orders by the subdirectories' ctimes, and records carry
+        // each subdirectory's size, times and mode
+        DIR *dir = command[9] == 't' || records ? opendir(home_dir) : NULL;
+        struct dirent *entry;
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            char path[PATH_MAX];
+            if (entry->d_type == DT_DIR &&
+                snprintf(path, sizeof(path), "%s/%s", home_dir, entry->d_name) < (int)sizeof(path) &&
+                stat(path, &sb) == 0) {
+                xxh64Update(&st, entry->d_name, strlen(entry->d_name) + 1);
+                if (records) {
+                    metadataStat(&st, &sb);
+                } else {
+                    xxh64Update(&st, &sb.st_ctim, sizeof(sb.st_ctim));
+                }
+            }
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+    } else if (strncmp(command, "w24fn ", 6) == 0) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", home_dir, command + 6);
+        if (stat(path, &sb) == 0) {
+            metadataStat(&st, &sb); // a missing file hashes as the command alone
+        }
+    } else {
+        return -1;
+    }
+    snprintf(tag, 17, "%016llx", xxh64Digest(&st));
+    return 0;
+}
+
+// A regular file selected for an archive
+typedef struct {
+    char *path; // absolute path on disk
+    const char *member_name; // points into path, relative to the home directory
+    off_t size;
+    struct timespec mtime;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    dev_t dev;
+    ino_t ino;
+    unsigned long long disk_position; // read-order key set by orderForReading
+} FileEntry;
+
+typedef struct {
+    FileEntry *items;
+    size_t count;
+    size_t capacity;
+} FileList;
+
+// Appends a regular file whose stat the caller already has
+int fileListAddStat(FileList *list, const char *path, const char *home_dir, const struct stat *sb) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        FileEntry *items = realloc(list->items, capacity * sizeof(FileEntry));
+        if (items == NULL) {
+            return -1;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    FileEntry *entry = &list->items[list->count];
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        return -1;
+    }
+    // Store members relative to the home directory, as tar -C would
+    size_t home_len = strlen(home_dir);
+    entry->member_name = entry->path;
+    if (strncmp(path, home_dir, home_len) == 0 && path[home_len] == '/') {
+        entry->member_name = entry->path + home_len + 1;
+    }
+    entry->size = sb->st_size;
+    entry->mtime = sb->st_mtim;
+    entry->mode = sb->st_mode;
+    entry->uid = sb->st_uid;
+    entry->gid = sb->st_gid;
+    entry->dev = sb->st_dev;
+    entry->ino = sb->st_ino;
+    list->count++;
+    return 0;
+}
+
+// Stats path and appends it if it is a regular file
+int fileListAdd(FileList *list, const char *path, const char *home_dir) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+    return fileListAddStat(list, path, home_dir, &st);
+}
+
+// Adds every path printed by a find command
+int fileListCollectFind(FileList *list, const char *find_cmd, const char *home_dir) {
+    unsigned long long start = statsNow();
+    DTRACE_PROBE1(w24, scan_start, find_cmd);
+    FILE *find_output = popen(find_cmd, "r");
+    if (!find_output) {
+        perror("Error executing find command");
+        return -1;
+    }
+    char file_path[PATH_MAX];
+    while (fgets(file_path, sizeof(file_path), find_output) != NULL) {
+        file_path[strcspn(file_path, "\n")] = '\0';
+        fileListAdd(list, file_path, home_dir);
+    }
+    int status = pclose(find_output);
+    statsRecord(STAGE_SCAN, start);
+    DTRACE_PROBE2(w24, scan_end, find_cmd, list->count);
+    return status == -1 ? -1 : 0;
+}
+
+int fileEntryCompare(const void *a, const void *b) {
+    return strcmp(((const FileEntry *)a)->member_name, ((const FileEntry *)b)->member_name);
+}
+
+// Physical offset of the first extent of a file, or -1 if FIEMAP cannot tell
+long long firstExtent(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent[1];
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    int ret = ioctl(fd, FS_IOC_FIEMAP, &request);
+    close(fd);
+    if (ret == -1) {
+        return -1;
+    }
+    // Empty and inline files have no extent; they cost no seek wherever they go
+    return request.map.fm_mapped_extents > 0 ? (long long)request.extent[0].fe_physical : 0;
+}
+
+const char *readOrder(void) {
+    const char *order = getenv("W24_READ_ORDER");
+    return order != NULL && (strcmp(order, "inode") == 0 || strcmp(order, "extent") == 0) ? order : "name";
+}
+
+int diskPositionCompare(const void *a, const void *b) {
+    const FileEntry *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->disk_position != y->disk_position) {
+        return x->disk_position < y->disk_position ? -1 : 1;
+    }
+    return strcmp(x->member_name, y->member_name);
+}
+
+// With W24_READ_ORDER=inode or extent, reorders a name-sorted list so that
+// members are read in one sweep across the disk instead of seeking between
+// directories. The set of members is unchanged, only their order in the archive.
+void orderForReading(FileList *list) {
+    const char *order = readOrder();
+    if (strcmp(order, "name") == 0) {
+        return;
+    }
+    int by_extent = strcmp(order, "extent") == 0;
+    for (size_t i = 0; by_extent && i < list->count; i++) {
+        long long position = firstExtent(list->items[i].path);
+        if (position == -1) {
+            logInfo("fiemap unavailable, ordering by inode", " path=%s", logQuote(list->items[i].path));
+            by_extent = 0;
+        }
+        list->items[i].disk_position = position;
+    }
+    for (size_t i = 0; !by_extent && i < list->count; i++) {
+        list->items[i].disk_position = list->items[i].ino;
+    }
+    qsort(list->items, list->count, sizeof(FileEntry), diskPositionCompare);
+}
+
+void fileListFree(FileList *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->items[i].path);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+// Content hashes of files, kept in HASH_INDEX_FILE as fixed-size records keyed
+// by inode, size and mtime so a file is read for hashing only once per change.
+// Handlers append records; a stale record simply never matches again.
+typedef struct {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    unsigned long long hash[2];
+} HashRecord;
+
+typedef struct {
+    HashRecord *items;
+    size_t count;
+    int fd; // open for appending new records, -1 if the index is unavailable
+} HashIndex;
+
+int hashRecordCompare(const void *a, const void *b) {
+    const HashRecord *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->mtime_sec != y->mtime_sec) {
+        return x->mtime_sec < y->mtime_sec ? -1 : 1;
+    }
+    return x->mtime_nsec < y->mtime_nsec ? -1 : x->mtime_nsec > y->mtime_nsec;
+}
+
+void hashIndexOpen(HashIndex *index) {
+    memset(index, 0, sizeof(*index));
+    index->fd = open(HASH_INDEX_FILE, O_RDWR | O_CREAT | O_APPEND, 0644);
+    struct stat st;
+    if (index->fd == -1 || fstat(index->fd, &st) == -1) {
+        perror("open hash index");
+        return;
+    }
+    // The index is only a cache, so when it grows too large it starts over
+    if (st.st_size > HASH_INDEX_MAX_BYTES) {
+        ftruncate(index->fd, 0);
+        return;
+    }
+    size_t count = st.st_size / sizeof(HashRecord);
+    index->items = malloc(count * sizeof(HashRecord) + 1);
+    if (index->items != NULL && pread(index->fd, index->items, count * sizeof(HashRecord), 0) ==
+                                    (ssize_t)(count * sizeof(HashRecord))) {
+        index->count = count;
+        qsort(index->items, count, sizeof(HashRecord), hashRecordCompare);
+    }
+}
+
+void hashIndexClose(HashIndex *index) {
+    if (index->fd != -1) {
+        close(index->fd);
+    }
+    free(index->items);
+}
+
+// Fills hash with a 128-bit content hash of entry, from the index or by reading the file
+int contentHash(HashIndex *index, const FileEntry *entry, unsigned long long hash[2]) {
+    HashRecord key;
+    memset(&key, 0, sizeof(key));
+    key.dev = entry->dev;
+    key.ino = entry->ino;
+    key.size = entry->size;
+    key.mtime_sec = entry->mtime.tv_sec;
+    key.mtime_nsec = entry->mtime.tv_nsec;
+    const HashRecord *hit = bsearch(&key, index->items, index->count, sizeof(HashRecord), hashRecordCompare);
+    if (hit != NULL) {
+        hash[0] = hit->hash[0];
+        hash[1] = hit->hash[1];
+        return 0;
+    }
+    int fd = open(entry->path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    Xxh64State st[2];
+    xxh64Init(&st[0], 0);
+    xxh64Init(&st[1], 1);
+    unsigned char buffer[65536];
+    long long total = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        xxh64Update(&st[0], buffer, n);
+        xxh64Update(&st[1], buffer, n);
+        total += n;
+    }
+    close(fd);
+    if (n == -1 || total != entry->size) {
+        return -1;
+    }
+    key.hash[0] = hash[0] = xxh64Digest(&st[0]);
+    key.hash[1] = hash[1] = xxh64Digest(&st[1]);
+    if (index->fd != -1 && write(index->fd, &key, sizeof(key)) != sizeof(key)) {
+        perror("write hash index");
+    }
+    return 0;
+}
+
+// A list entry taking part in duplicate detection
+typedef struct {
+    size_t item;
+    long long size;
+    unsigned long long hash[2];
+} DedupSlot;
+
+int dedupSizeCompare(const void *a, const void *b) {
+    const DedupSlot *x = a, *y = b;
+    return x->size < y->size ? -1 : x->size > y->size;
+}
+
+int dedupHashCompare(const void *a, const void *b) {
+    const DedupSlot *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (x->hash[i] != y->hash[i]) {
+            return x->hash[i] < y->hash[i] ? -1 : 1;
+        }
+    }
+    return x->item < y->item ? -1 : x->item > y->item;
+}
+
+// Sets link_to[i] to the earlier list item with the same content as item i,
+// or -1. Only files sharing their size with another file are hashed.
+void findDuplicates(const FileList *list, long *link_to) {
+    DedupSlot *slots = malloc((list->count + 1) * sizeof(DedupSlot));
+    for (size_t i = 0; i < list->count; i++) {
+        link_to[i] = -1;
+        if (slots != NULL) {
+            slots[i].item = i;
+            slots[i].size = list->items[i].size;
+        }
+    }
+    if (slots == NULL) {
+        return;
+    }
+    qsort(slots, list->count, sizeof(DedupSlot), dedupSizeCompare);
+    // The index is loaded only once some size is shared, since most results have no duplicates
+    HashIndex index;
+    int index_open = 0;
+    size_t hashed = 0;
+    for (size_t i = 0; i < list->count;) {
+        size_t j = i;
+        while (j < list->count && slots[j].size == slots[i].size) {
+            j++;
+        }
+        // Empty files gain nothing from linking
+        if (j - i > 1 && slots[i].size > 0 && !index_open) {
+            hashIndexOpen(&index);
+            index_open = 1;
+        }
+        for (size_t k = i; j - i > 1 && slots[i].size > 0 && k < j; k++) {
+            if (contentHash(&index, &list->items[slots[k].item], slots[k].hash) == 0) {
+                slots[hashed++] = slots[k];
+            }
+        }
+        i = j;
+    }
+    if (index_open) {
+        hashIndexClose(&index);
+    }
+    qsort(slots, hashed, sizeof(DedupSlot), dedupHashCompare);
+    for (size_t i = 1; i < hashed; i++) {
+        if (slots[i - 1].size == slots[i].size && slots[i - 1].hash[0] == slots[i].hash[0] &&
+            slots[i - 1].hash[1] == slots[i].hash[1]) {
+            // Within a group the first slot is the earliest item, which carries the data
+            link_to[slots[i].item] = link_to[slots[i - 1].item] != -1 ? link_to[slots[i - 1].item]
+                                                                      : (long)slots[i - 1].item;
+        }
+    }
+    free(slots);
+}
+
+// True if the file still has the size and mtime it had when it was listed
+int fileUnchanged(const FileEntry *entry) {
+    struct stat st;
+    return stat(entry->path, &st) == 0 && st.st_size == entry->size && st.st_mtim.tv_sec == entry->mtime.tv_sec &&
+           st.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+// True if two files hold the same bytes. Hashes only nominate candidates; a
+// link is written only after the contents have been compared.
+int sameContent(const char *path_a, const char *path_b) {
+    int fd_a = open(path_a, O_RDONLY);
+    int fd_b = open(path_b, O_RDONLY);
+    int same = fd_a != -1 && fd_b != -1;
+    unsigned char buffer_a[65536], buffer_b[65536];
+    while (same) {
+        ssize_t n = read(fd_a, buffer_a, sizeof(buffer_a));
+        if (n <= 0) {
+            // Both must end together
+            same = n == 0 && read(fd_b, buffer_b, 1) == 0;
+            break;
+        }
+        ssize_t got = 0;
+        while (got < n) {
+            ssize_t m = read(fd_b, buffer_b + got, n - got);
+            if (m <= 0) {
+                break;
+            }
+            got += m;
+        }
+        same = got == n && memcmp(buffer_a, buffer_b, n) == 0;
+    }
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    return same;
+}
+
+// Number of upcoming files whose reads are started ahead of the writer
+int prefetchDepth(void) {
+    const char *depth = getenv("W24_PREFETCH_DEPTH");
+    return depth != NULL && *depth != '\0' ? atoi(depth) : PREFETCH_DEPTH;
+}
+
+// Asks the kernel to start reading a file into the page cache; returns the bytes advised
+long long prefetchFile(const FileEntry *entry) {
+    int fd = open(entry->path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    off_t length = entry->size < PREFETCH_MAX_BYTES ? entry->size : PREFETCH_MAX_BYTES;
+    int ret = posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+    close(fd);
+    return ret == 0 ? length : 0;
+}
+
+// Writes every file of the list through an opened writer and closes it
+int writeArchive(ArchiveWriter *aw, const FileList *list) {
+    // Repeated content is stored once; later copies become hard links to it
+    long *link_to = malloc((list->count + 1) * sizeof(long));
+    char *archived = calloc(list->count + 1, 1);
+    if (link_to != NULL && archived != NULL) {
+        findDuplicates(list, link_to);
+    }
+    int linked = 0;
+    // The disk fetches the next files while the current one is compressed
+    int depth = prefetchDepth();
+    size_t next_prefetch = 0;
+    int prefetched = 0;
+    long long prefetched_bytes = 0;
+    for (size_t i = 0; i < list->count && !aw->failed; i++) {
+        const FileEntry *entry = &list->items[i];
+        long target = link_to != NULL && archived != NULL ? link_to[i] : -1;
+        for (; depth > 0 && next_prefetch < list->count && next_prefetch <= i + depth; next_prefetch++) {
+            // Hard links carry no data, so there is nothing to fetch for them
+            if (next_prefetch > i && (link_to == NULL || link_to[next_prefetch] == -1)) {
+                prefetched_bytes += prefetchFile(&list->items[next_prefetch]);
+                prefetched++;
+            }
+        }
+        if (target != -1 && archived[target] && fileUnchanged(entry) && fileUnchanged(&list->items[target]) &&
+            sameContent(list->items[target].path, entry->path) &&
+            archiveAddLink(aw, entry->path, entry->member_name, list->items[target].member_name) == 0) {
+            linked++;
+            continue;
+        }
+        // A link that failed part way leaves nothing to append the full copy to
+        if (aw->failed) {
+            break;
+        }
+        if (archiveAddFile(aw, entry->path, entry->member_name) == 0 && archived != NULL) {
+            // Only a copy that was archived as hashed can stand in for the others
+            archived[i] = fileUnchanged(entry);
+        }
+    }
+    free(link_to);
+    free(archived);
+    int members = aw->members;
+    int stored_members = aw->stored_members;
+    int ret = archiveClose(aw);
+    logInfo("archive built", " members=%d stored=%d links=%d prefetch_depth=%d prefetched=%d prefetched_bytes=%lld", members,
+            stored_members, linked, depth, prefetched, prefetched_bytes);
+    return ret;
+}
+
+// Writes every file of the list into a new archive at archive_path
+int buildArchive(const FileList *list, const char *archive_path) {
+    ArchiveWriter aw;
+    if (archiveOpen(&aw, archive_path) == -1) {
+        return -1;
+    }
+    return writeArchive(&aw, list);
+}
+
+// Content-addressed key: the normalized command plus (path, size, mtime, mode,
+// owner) of every match, which is everything tarHeader writes
+void archiveCacheKey(const char *normalized_command, const FileList *list, char key[33]) {
+    Xxh64State st[2];
+    char layout[64];
+    const char *sample = getenv("W24_ENTROPY_SAMPLE");
+    snprintf(layout, sizeof(layout), "level=%d sample=%s links order=%s", ARCHIVE_LEVEL, sample != NULL ? sample : "",
+             readOrder());
+    for (int s = 0; s < 2; s++) {
+        xxh64Init(&st[s], s);
+        xxh64Update(&st[s], normalized_command, strlen(normalized_command) + 1);
+        // Settings that change the bytes written, so that equal keys mean identical archives
+        xxh64Update(&st[s], layout, strlen(layout) + 1);
+        for (size_t i = 0; i < list->count; i++) {
+            const FileEntry *entry = &list->items[i];
+            long long fields[6] = {entry->size, entry->mtime.tv_sec, entry->mtime.tv_nsec,
+                                   entry->mode, entry->uid, entry->gid};
+            xxh64Update(&st[s], entry->path, strlen(entry->path) + 1);
+            xxh64Update(&st[s], fields, sizeof(fields));
+        }
+    }
+    snprintf(key, 33, "%016llx%016llx", xxh64Digest(&st[0]), xxh64Digest(&st[1]));
+}
+
+// A file in the archive cache directory
+typedef struct {
+    char path[PATH_MAX];
+    struct stat st;
+} CacheEntry;
+
+int cacheEntryCompare(const void *a, const void *b) {
+    const struct stat *sa = &((const CacheEntry *)a)->st;
+    const struct stat *sb = &((const CacheEntry *)b)->st;
+    if (sa->st_mtim.tv_sec != sb->st_mtim.tv_sec) {
+        return sa->st_mtim.tv_sec < sb->st_mtim.tv_sec ? -1 : 1;
+    }
+    return (sa->st_mtim.tv_nsec > sb->st_mtim.tv_nsec) - (sa->st_mtim.tv_nsec < sb->st_mtim.tv_nsec);
+}
+
+long long archiveRetention(void) {
+    const char *retention = getenv("W24_ARCHIVE_RETENTION");
+    return retention != NULL && *retention != '\0' ? atoll(retention) : ARCHIVE_RETENTION_SECONDS;
+}
+
+// Removes least recently used entries until the cache fits in max_bytes. keep
+// names the entry about to be served, which stays even if it alone exceeds the limit.
+void archiveCacheEvict(long long max_bytes, const char *keep) {
+    DIR *dir = opendir(CACHE_DIR);
+    if (dir == NULL) {
+        return;
+    }
+    CacheEntry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strstr(entry->d_name, ".tar.gz") == NULL) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            CacheEntry *grown = realloc(entries, capacity * sizeof(CacheEntry));
+            if (grown == NULL) {
+                break;
+            }
+            entries = grown;
+        }
+        snprintf(entries[count].path, PATH_MAX, "%s/%s", CACHE_DIR, entry->d_name);
+        if (stat(entries[count].path, &entries[count].st) == 0) {
+            total += entries[count].st.st_size;
+            count++;
+        }
+    }
+    closedir(dir);
+    // Hits refresh the mtime, so the oldest mtime is the least recently used entry.
+    // Entries unused for longer than the retention time go regardless of size.
+    qsort(entries, count, sizeof(CacheEntry), cacheEntryCompare);
+    time_t expired_before = time(NULL) - archiveRetention();
+    for (size_t i = 0; i < count; i++) {
+        if (total <= max_bytes && entries[i].st.st_mtime >= expired_before) {
+            break;
+        }
+        if (keep != NULL && strcmp(entries[i].path, keep) == 0) {
+            continue;
+        }
+        if (unlink(entries[i].path) == 0) {
+            logInfo("evicted cached archive", " path=%s", logQuote(entries[i].path));
+            total -= entries[i].st.st_size;
+        }
+    }
+    free(entries);
+}
+
+long long archiveCacheLimit(void) {
+    const char *limit = getenv("W24_CACHE_MAX_BYTES");
+    return limit != NULL && *limit != '\0' ? atoll(limit) : CACHE_MAX_BYTES;
+}
+
+// Resolves the archive for a query, building and caching it on a miss.
+// On success archive_path names the cache entry and *fd is open on it; the fd
+// keeps the bytes reachable even if the entry is evicted before it is sent.
+int prepareArchive(const char *normalized_command, FileList *list, char *archive_path, size_t path_len, int *fd) {
+    if (mkdir(CACHE_DIR, PERMISSIONS) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+    // Sort so that equal result sets always produce the same key and layout. The key
+    // covers the member order, so a disk-based read order yields its own entry.
+    unsigned long long start = statsNow();
+    qsort(list->items, list->count, sizeof(FileEntry), fileEntryCompare);
+    orderForReading(list);
+    char key[33];
+    archiveCacheKey(normalized_command, list, key);
+    statsRecord(STAGE_FILTER, start);
+    snprintf(archive_path, path_len, "%s/%s.tar.gz", CACHE_DIR, key);
+    // A hit is only a hit if it can be opened; an entry evicted since the lookup is rebuilt
+    *fd = open(archive_path, O_RDONLY);
+    if (*fd != -1) {
+        logInfo("archive cache hit", " path=%s", logQuote(archive_path));
+        futimens(*fd, NULL);
+        return 0;
+    }
+    // Build in the work area and publish atomically so readers never see a partial entry
+    const char *scratch = workArea();
+    if (scratch == NULL) {
+        return -1;
+    }
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp", scratch, key);
+    start = statsNow();
+    if (buildArchive(list, tmp_path) == -1) {
+        unlink(tmp_path);
+        return -1;
+    }
+    *fd = open(tmp_path, O_RDONLY);
+    if (*fd == -1 || rename(tmp_path, archive_path) == -1) {
+        perror("publish archive");
+        if (*fd != -1) {
+            close(*fd);
+        }
+        unlink(tmp_path);
+        return -1;
+    }
+    statsRecord(STAGE_ARCHIVE, start);
+    archiveCacheEvict(archiveCacheLimit(), archive_path);
+    return 0;
+}
+
+// Archive ids are "<node>.<cache key>". The node part lets serverw24 route a
+// follow-up w24get back to the node holding the archive.
+void archiveIdFromPath(const char *archive_path, char *id, size_t size) {
+    const char *base = strrchr(archive_path, '/');
+    base = base != NULL ? base + 1 : archive_path;
+    snprintf(id, size, "%s.%.*s", NODE_NAME, (int)strcspn(base, "."), base);
+}
+
+// Returns the cache key part of an archive id, or NULL if it is malformed
+const char *archiveKeyFromId(const char *id) {
+    const char *key = strrchr(id, '.');
+    key = key != NULL ? key + 1 : id;
+    if (strlen(key) != 32 || strspn(key, "0123456789abcdef") != 32) {
+        return NULL;
+    }
+    return key;
+}
+
+// Function to manage w24get: sends a byte range of a retained archive so that
+// interrupted downloads can resume without rebuilding the archive
+void performw24get(int client_socket, const char *id, long long offset, long long length) {
+    const char *key = archiveKeyFromId(id);
+    if (key == NULL) {
+        send_response(client_socket, "Invalid archive id");
+        return;
+    }
+    char archive_path[PATH_MAX];
+    snprintf(archive_path, sizeof(archive_path), "%s/%s.tar.gz", CACHE_DIR, key);
+    // Open before anything else: once open, eviction from the cache cannot pull the file away
+    int fd = open(archive_path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_mtime < time(NULL) - archiveRetention()) {
+        if (fd != -1) {
+            close(fd);
+        }
+        send_response(client_socket, "Archive expired");
+        return;
+    }
+    // Keep the archive alive while it is being fetched
+    futimens(fd, NULL);
+    if (send_archive(client_socket, fd, archive_path, offset, length) == -1) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Delta sync: the client uploads a manifest of the files it already holds
+// (size, mtime and per-block weak/strong checksums) and the reply carries only
+// new files and the changed parts of modified ones, as rsync does
+typedef struct {
+    unsigned int weak;
+    unsigned long long strong;
+    long long index;
+} BlockSum;
+
+typedef struct {
+    const char *path; // relative to the home directory, points into the manifest text
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long block_size;
+    size_t block_count;
+    BlockSum *blocks; // sorted by weak checksum
+} ManifestEntry;
+
+typedef struct {
+    ManifestEntry *items;
+    size_t count;
+} Manifest;
+
+// Set while serving "w24sync": archive handlers reply with a delta against it
+Manifest *sync_manifest = NULL;
+
+// rsync's rolling checksum over len bytes: a is the byte sum, b the sum of the
+// running values of a. Only the low 16 bits of each take part.
+void weakBegin(const unsigned char *data, size_t len, unsigned int *a, unsigned int *b) {
+    *a = 0;
+    *b = 0;
+    for (size_t i = 0; i < len; i++) {
+        *a += data[i];
+        *b += *a;
+    }
+}
+
+unsigned int weakValue(unsigned int a, unsigned int b) {
+    return (a & 0xffff) | (b << 16);
+}
+
+int blockSumCompare(const void *a, const void *b) {
+    unsigned int x = ((const BlockSum *)a)->weak, y = ((const BlockSum *)b)->weak;
+    return x < y ? -1 : x > y;
+}
+
+int manifestEntryCompare(const void *a, const void *b) {
+    return strcmp(((const ManifestEntry *)a)->path, ((const ManifestEntry *)b)->path);
+}
+
+void manifestFree(Manifest *manifest) {
+    for (size_t i = 0; i < manifest->count; i++) {
+        free(manifest->items[i].blocks);
+    }
+    free(manifest->items);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+// Parses "<path>\t<size>\t<sec>\t<nsec>\t<block size>\t<blocks>\n" lines, each
+// followed by one "<weak hex> <strong hex>\n" line per block. Paths point into text.
+int manifestParse(Manifest *manifest, char *text) {
+    size_t capacity = 0;
+    memset(manifest, 0, sizeof(*manifest));
+    char *line = text;
+    while (*line != '\0') {
+        char *tab = strchr(line, '\t');
+        char *end = strchr(line, '\n');
+        if (tab == NULL || end == NULL || tab > end) {
+            manifestFree(manifest);
+            return -1;
+        }
+        *tab = '\0';
+        *end = '\0';
+        ManifestEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.path = line;
+        if (sscanf(tab + 1, "%lld %lld %lld %lld %zu", &entry.size, &entry.mtime_sec, &entry.mtime_nsec,
+                   &entry.block_size, &entry.block_count) != 5 ||
+            entry.block_size <= 0 || entry.block_count > (size_t)(entry.size / entry.block_size + 1)) {
+            manifestFree(manifest);
+            return -1;
+        }
+        line = end + 1;
+        entry.blocks = malloc((entry.block_count + 1) * sizeof(BlockSum));
+        for (size_t i = 0; entry.blocks != NULL && i < entry.block_count; i++) {
+            char *next;
+            entry.blocks[i].weak = strtoul(line, &next, 16);
+            entry.blocks[i].strong = strtoull(next, &next, 16);
+            entry.blocks[i].index = i;
+            if (*next != '\n') {
+                free(entry.blocks);
+                entry.blocks = NULL;
+                break;
+            }
+            line = next + 1;
+        }
+        if (manifest->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ManifestEntry *items = realloc(manifest->items, capacity * sizeof(ManifestEntry));
+            if (items == NULL) {
+                free(entry.blocks);
+                entry.blocks = NULL;
+            } else {
+                manifest->items = items;
+            }
+        }
+        if (entry.blocks == NULL) {
+            manifestFree(manifest);
+            return -1;
+        }
+        qsort(entry.blocks, entry.block_count, sizeof(BlockSum), blockSumCompare);
+        manifest->items[manifest->count++] = entry;
+    }
+    qsort(manifest->items, manifest->count, sizeof(ManifestEntry), manifestEntryCompare);
+    return 0;
+}
+
+ManifestEntry *manifestFind(Manifest *manifest, const char *path) {
+    ManifestEntry key;
+    key.path = path;
+    return bsearch(&key, manifest->items, manifest->count, sizeof(ManifestEntry), manifestEntryCompare);
+}
+
+// Finds a client block whose checksums match len bytes at data
+const BlockSum *blockFind(const ManifestEntry *old, unsigned int weak, const unsigned char *data, size_t len) {
+    BlockSum key;
+    key.weak = weak;
+    const BlockSum *hit = bsearch(&key, old->blocks, old->block_count, sizeof(BlockSum), blockSumCompare);
+    if (hit == NULL) {
+        return NULL;
+    }
+    while (hit > old->blocks && hit[-1].weak == weak) {
+        hit--;
+    }
+    Xxh64State st;
+    xxh64Init(&st, 0);
+    xxh64Update(&st, data, len);
+    unsigned long long strong = xxh64Digest(&st);
+    for (; hit < old->blocks + old->block_count && hit->weak == weak; hit++) {
+        if (hit->strong == strong) {
+            return hit;
+        }
+    }
+    return NULL;
+}
+
+// Writes "FILE <size> <sec> <nsec> <block size> <path>" records made of
+// "LIT <n>" (followed by n bytes) and "COPY <first block> <count>" operations,
+// each record ending with "END"
+typedef struct {
+    FILE *out;
+    long long copy_first;
+    long long copy_count;
+    int files;
+    int unchanged;
+    long long literal_bytes;
+    long long copied_bytes;
+} DeltaWriter;
+
+void deltaFlushCopy(DeltaWriter *dw) {
+    if (dw->copy_count > 0) {
+        fprintf(dw->out, "COPY %lld %lld\n", dw->copy_first, dw->copy_count);
+        dw->copy_count = 0;
+    }
+}
+
+void deltaLiteral(DeltaWriter *dw, const unsigned char *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    deltaFlushCopy(dw);
+    fprintf(dw->out, "LIT %zu\n", len);
+    fwrite(data, 1, len, dw->out);
+    dw->literal_bytes += len;
+}
+
+void deltaCopy(DeltaWriter *dw, long long index, size_t len) {
+    if (dw->copy_count > 0 && index == dw->copy_first + dw->copy_count) {
+        dw->copy_count++;
+    } else {
+        deltaFlushCopy(dw);
+        dw->copy_first = index;
+        dw->copy_count = 1;
+    }
+    dw->copied_bytes += len;
+}
+
+// Emits one file, reusing blocks of the client's copy (old, may be NULL) wherever they still occur
+void deltaFile(DeltaWriter *dw, const FileEntry *entry, const ManifestEntry *old) {
+    int fd = open(entry->path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        // Vanished since the search; the client keeps what it has
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    unsigned char *data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            return;
+        }
+    }
+    size_t size = st.st_size;
+    size_t block_size = old != NULL ? (size_t)old->block_size : DELTA_BLOCK_SIZE;
+    fprintf(dw->out, "FILE %lld %lld %ld %zu %s\n", (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+            st.st_mtim.tv_nsec, block_size, entry->member_name);
+    size_t literal_start = 0;
+    if (old != NULL && old->block_count > 0) {
+        size_t i = 0;
+        unsigned int a = 0, b = 0;
+        int rolling = 0;
+        while (i + block_size <= size) {
+            if (!rolling) {
+                weakBegin(data + i, block_size, &a, &b);
+                rolling = 1;
+            }
+            const BlockSum *hit = blockFind(old, weakValue(a, b), data + i, block_size);
+            if (hit != NULL) {
+                deltaLiteral(dw, data + literal_start, i - literal_start);
+                deltaCopy(dw, hit->index, block_size);
+                i += block_size;
+                literal_start = i;
+                rolling = 0;
+                continue;
+            }
+            // Slide the window one byte
+            if (i + block_size < size) {
+                a += data[i + block_size] - data[i];
+                b += a - block_size * data[i];
+            }
+            i++;
+        }
+    }
+    deltaLiteral(dw, data + literal_start, size - literal_start);
+    deltaFlushCopy(dw);
+    fputs("END\n", dw->out);
+    dw->files++;
+    if (data != NULL) {
+        munmap(data, st.st_size);
+    }
+    close(fd);
+}
+
+// Replies to a query with a delta against the client's manifest, framed as
+// "DELTA <length>\n" followed by the records and a final "DONE" line
+int serveDelta(int client_socket, FileList *list) {
+    const char *scratch = workArea();
+    if (scratch == NULL) {
+        return -1;
+    }
+    char delta_path[PATH_MAX];
+    snprintf(delta_path, sizeof(delta_path), "%s/delta", scratch);
+    DeltaWriter dw;
+    memset(&dw, 0, sizeof(dw));
+    dw.out = fopen(delta_path, "w+");
+    if (dw.out == NULL) {
+        perror("fopen delta");
+        return -1;
+    }
+    unlink(delta_path);
+    qsort(list->items, list->count, sizeof(FileEntry), fileEntryCompare);
+    for (size_t i = 0; i < list->count; i++) {
+        const FileEntry *entry = &list->items[i];
+        const ManifestEntry *old = manifestFind(sync_manifest, entry->member_name);
+        if (old != NULL && old->size == entry->size && old->mtime_sec == entry->mtime.tv_sec &&
+            old->mtime_nsec == entry->mtime.tv_nsec) {
+            dw.unchanged++;
+            continue;
+        }
+        deltaFile(&dw, entry, old);
+    }
+    fputs("DONE\n", dw.out);
+    if (fflush(dw.out) != 0 || ferror(dw.out)) {
+        perror("write delta");
+        fclose(dw.out);
+        return -1;
+    }
+    long long length = ftell(dw.out);
+    char header[64];
+    int header_len = snprintf(header, sizeof(header), "DELTA %lld\n", length);
+    if (send(client_socket, header, header_len, MSG_MORE) == -1 ||
+        send_file_range(client_socket, fileno(dw.out), 0, length) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    DTRACE_PROBE1(w24, send_done, header_len + length);
+    fclose(dw.out);
+    logInfo("delta sent", " changed=%d unchanged=%d literal_bytes=%lld copied_bytes=%lld", dw.files, dw.unchanged,
+            dw.literal_bytes, dw.copied_bytes);
+    return 0;
+}
+
+// Function to manage w24sync: takes the client's manifest, then runs the query
+// with its reply turned into a delta
+void performw24sync(int client_socket, long long manifest_len, const char *command) {
+    if (manifest_len < 0 || manifest_len > DELTA_MANIFEST_MAX || strncmp(command, "w24f", 4) != 0 ||
+        strncmp(command, "w24fn", 5) == 0) {
+        send_response(client_socket, "Invalid w24sync format");
+        return;
+    }
+    char *text = malloc(manifest_len + 1);
+    if (text == NULL) {
+        send_response(client_socket, "Manifest too large");
+        return;
+    }
+    // Tell the client to go ahead, then take the manifest
+    if (send(client_socket, "READY\n", 6, 0) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    for (long long got = 0; got < manifest_len;) {
+        ssize_t n = recv(client_socket, text + got, manifest_len - got, 0);
+        if (n <= 0) {
+            exit(EXIT_FAILURE);
+        }
+        got += n;
+    }
+    text[manifest_len] = '\0';
+    Manifest manifest;
+    if (manifestParse(&manifest, text) == -1) {
+        free(text);
+        send_response(client_socket, "Invalid manifest");
+        return;
+    }
+    sync_manifest = &manifest;
+    manage_command(client_socket, command);
+    sync_manifest = NULL;
+    manifestFree(&manifest);
+    free(text);
+}
+
+// Sends the archive for a query to the client. With caching disabled the
+// archive is streamed in chunks straight from the writer and never touches
+// disk. Returns -1 only if nothing was sent, so the caller can still reply.
+int serveArchive(int client_socket, const char *normalized_command, FileList *list) {
+    unsigned long long start = statsNow();
+    if (sync_manifest != NULL) {
+        int status = serveDelta(client_socket, list);
+        statsRecord(STAGE_ARCHIVE, start);
+        return status;
+    }
+    if (archiveCacheLimit() <= 0 && stripe_count > 0) {
+        // Shares are cut from a finished archive, which needs the cache to hold it
+        return -1;
+    }
+    if (archiveCacheLimit() <= 0) {
+        qsort(list->items, list->count, sizeof(FileEntry), fileEntryCompare);
+        orderForReading(list);
+        statsRecord(STAGE_FILTER, start);
+        start = statsNow();
+        ArchiveWriter aw;
+        if (archiveOpenStream(&aw, client_socket) == -1) {
+            return -1;
+        }
+        if (send(client_socket, "ARCHIVE chunked\n", strlen("ARCHIVE chunked\n"), 0) == -1) {
+            perror("send");
+            archiveClose(&aw);
+            return -1;
+        }
+        if (writeArchive(&aw, list) == -1) {
+            // The reply is already under way, so the only way to signal failure is to hang up
+            fprintf(stderr, "Error streaming tar archive\n");
+            exit(EXIT_FAILURE);
+        }
+        // Built and sent at once, so this counts as archive time
+        statsRecord(STAGE_ARCHIVE, start);
+        DTRACE_PROBE1(w24, send_done, aw.bytes_out);
+        return 0;
+    }
+    char archive_path[PATH_MAX];
+    int fd;
+    if (prepareArchive(normalized_command, list, archive_path, sizeof(archive_path), &fd) == -1) {
+        return -1;
+    }
+    long long offset = 0, length = -1;
+    struct stat st;
+    if (stripe_count > 0 && fstat(fd, &st) == 0) {
+        // Every node builds identical bytes, so equal shares of the total line up
+        if (st.st_size < STRIPE_MIN_BYTES) {
+            length = stripe_index == 0 ? st.st_size : 0;
+        } else {
+            offset = st.st_size * stripe_index / stripe_count;
+            length = st.st_size * (stripe_index + 1) / stripe_count - offset;
+        }
+    }
+    if (send_archive(client_socket, fd, archive_path, offset, length) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+void performw24fz(int client_socket, long size1, long size2) {
+    const char *w24project_path = "./w24project";
+    //Create w24project directory if it doesn't exist
+    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+ 
+    logDebug("handling w24fz", " min=%ld max=%ld", size1, size2);
+ 
+    if (size1 < 0 || size2 < 0 || size1 > size2) {
+        // Invalid size range
+        logWarn("invalid size range", " min=%ld max=%ld", size1, size2);
+        send_response(client_socket, "Invalid size range");
+        return;
+    }
+ 
+    const char *home_dir = rootDir();
+    if (home_dir == NULL) {
+        perror("getenv");
+        exit(EXIT_FAILURE);
+    }
+ 
+    unsigned long long scan_start = statsNow();
+    DTRACE_PROBE1(w24, scan_start, home_dir);
+    DIR *dir = opendir(home_dir);
+    if (dir == NULL) {
+        perror("opendir");
+        send_response(client_socket, "Error opening directory");
+        return;
+    }
+ 
+    logDebug("scanning", " dir=%s", logQuote(home_dir));
+ 
+    // Collect the files within the size range
+    FileList list = {0};
+ 
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        snprintf(path, PATH_MAX, "%s/%s", home_dir, entry->d_name);
+ 
+        struct stat statbuf;
+        if (stat(path, &statbuf) == -1) {
+            perror("stat");
+            continue;
+        }
+ 
+        if (S_ISREG(statbuf.st_mode) && statbuf.st_size >= size1 && statbuf.st_size <= size2) {
+            logDebug("matching file", " file=%s", logQuote(entry->d_name));
+            fileListAdd(&list, path, home_dir);
+        }
+    }
+ 
+    closedir(dir);
+    statsRecord(STAGE_SCAN, scan_start);
+    DTRACE_PROBE2(w24, scan_end, home_dir, list.count);
+ 
+    if (list.count == 0) {
+        // No files found in the specified size range
+        logInfo("no files in size range", " min=%ld max=%ld", size1, size2);
+        send_response(client_socket, "No file found");
+        return;
+    }
+ 
+    // Send a cached archive for the same query and matches, or build one
+    char normalized_command[BUFFER_SIZE];
+    snprintf(normalized_command, sizeof(normalized_command), "w24fz %ld %ld", size1, size2);
+    int status = serveArchive(client_socket, normalized_command, &list);
+    fileListFree(&list);
+    if (status == -1) {
+        fprintf(stderr, "Error creating tar file\n");
+        send_response(client_socket, "Error creating tar file");
+        return;
+    }
+}
+
+void performw24fdb(int client_socket, char *date) {
+    const char *w24project_path = "./w24project";
+    // Check if the date argument is provided
+    if (date == NULL) {
+        send_response(client_socket, "No date provided");
+        return;
+    }
+    // Create w24project directory if it doesn't exist
+    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+ 
+    // Skip the separator left between the command and the date
+    while (*date == ' ') {
+        date++;
+    }
+ 
+    // Construct the find command to list files created or modified on or before the provided date
+    char find_cmd[BUFFER_SIZE];
+    snprintf(find_cmd, BUFFER_SIZE, "find \"%s\" -type f -not -newermt \"%s\"", rootDir(), date);
+    logDebug("running find", " command=%s", logQuote(find_cmd));
+ 
+    FileList list = {0};
+    if (fileListCollectFind(&list, find_cmd, rootDir()) == -1) {
+        fileListFree(&list);
+        send_response(client_socket, "Error executing find command");
+        return;
+    }
+    logDebug("find done", " files=%zu", list.count);
+ 
+    // Send a cached archive for the same query and matches, or build one
+    char normalized_command[BUFFER_SIZE];
+    snprintf(normalized_command, sizeof(normalized_command), "w24fdb %s", date);
+    int status = serveArchive(client_socket, normalized_command, &list);
+    fileListFree(&list);
+    if (status == -1) {
+        fprintf(stderr, "Error creating tar file\n");
+        send_response(client_socket, "Error creating tar file");
+        return;
+    }
+}
+
+
+void performw24fda(int client_socket, char *date) {
+    const char *w24project_path = "./w24project";
+    // Check if the date argument is provided
+    if (date == NULL) {
+        send_response(client_socket, "No date provided");
+        return;
+    }
+    // Create w24project directory if it doesn't exist
+    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+ 
+    // Skip the separator left between the command and the date
+    while (*date == ' ') {
+        date++;
+    }
+ 
+    // Construct the find command to list files created or modified on or after the provided date
+    char find_cmd[BUFFER_SIZE];
+    snprintf(find_cmd, BUFFER_SIZE, "find \"%s\" -type f -newermt \"%s\"", rootDir(), date);
+    logDebug("running find", " command=%s", logQuote(find_cmd));
+ 
+    FileList list = {0};
+    if (fileListCollectFind(&list, find_cmd, rootDir()) == -1) {
+        fileListFree(&list);
+        send_response(client_socket, "Error executing find command");
+        return;
+    }
+    logDebug("find done", " files=%zu", list.count);
+ 
+    // Send a cached archive for the same query and matches, or build one
+    char normalized_command[BUFFER_SIZE];
+    snprintf(normalized_command, sizeof(normalized_command), "w24fda %s", date);
+    int status = serveArchive(client_socket, normalized_command, &list);
+    fileListFree(&list);
+    if (status == -1) {
+        fprintf(stderr, "Error creating tar file\n");
+        send_response(client_socket, "Error creating tar file");
+        return;
+    }
+}
+
+
+// Combined query: "w24fq [size=<min>-<max>] [ext=<ext>,...] [after=<date>]
+// [before=<date>] [name=<pattern>] [list]" finds the regular files below the
+// home directory that satisfy every term given, in one walk. Sizes take K, M
+// and G suffixes and either bound may be left out; dates are YYYY-MM-DD or
+// YYYY-MM-DDTHH:MM:SS in local time, compared as find -newermt does. The
+// result is archived, or with "list" sent as a listing (records under w24bin).
+//
+// Terms on the name cost nothing, so they run before the one fstatat the
+// others need, and files they reject are never stat'ed. Within each group the
+// term that has rejected the most files runs first: the order starts from the
+// pass rates of earlier queries on this node and is redone every
+// QUERY_REORDER_INTERVAL files from what this walk has seen.
+#define QUERY_MAX_EXTENSIONS 16
+#define QUERY_REORDER_INTERVAL 1024
+
+static const char *query_term_names[QUERY_TERMS] = {"name", "ext", "size", "after", "before"};
+
+typedef struct {
+    char name[256];
+    char *extensions[QUERY_MAX_EXTENSIONS];
+    int ext_count;
+    long long min_size, max_size;
+    time_t after, before;
+    int active[QUERY_TERMS];
+    int order[QUERY_TERMS]; // active terms, in the order they are tried
+    int count;
+    unsigned long long evaluated[QUERY_TERMS];
+    unsigned long long passed[QUERY_TERMS];
+    unsigned long long files; // regular files the walk has reached
+    int list;
+} Query;
+
+int queryNeedsStat(int term) {
+    return term != QUERY_NAME && term != QUERY_EXT;
+}
+
+// Share of files the term lets through, from this walk and earlier queries
+double queryPassRate(const Query *q, int term) {
+    unsigned long long evaluated = q->evaluated[term], passed = q->passed[term];
+    if (node_stats != NULL) {
+        evaluated += __atomic_load_n(&node_stats->query_evaluated[term], __ATOMIC_RELAXED);
+        passed += __atomic_load_n(&node_stats->query_passed[term], __ATOMIC_RELAXED);
+    }
+    return (passed + 1.0) / (evaluated + 2.0);
+}
+
+void queryRank(Query *q) {
+    for (int i = 1; i < q->count; i++) {
+        int term = q->order[i], j = i;
+        double rate = queryPassRate(q, term);
+        while (j > 0 && (queryNeedsStat(q->order[j - 1]) > queryNeedsStat(term) ||
+                         (queryNeedsStat(q->order[j - 1]) == queryNeedsStat(term) &&
+                          queryPassRate(q, q->order[j - 1]) > rate))) {
+            q->order[j] = q->order[j - 1];
+            j--;
+        }
+        q->order[j] = term;
+    }
+}
+
+// Parses "<number>[K|M|G]"; an empty bound keeps the default
+int querySize(const char *s, const char *end, long long *value) {
+    if (s == end) {
+        return 0;
+    }
+    char *unit;
+    long long n = strtoll(s, &unit, 10);
+    if (unit == s || n < 0) {
+        return -1;
+    }
+    if (unit < end && (*unit == 'K' || *unit == 'k')) {
+        n <<= 10;
+        unit++;
+    } else if (unit < end && (*unit == 'M' || *unit == 'm')) {
+        n <<= 20;
+        unit++;
+    } else if (unit < end && (*unit == 'G' || *unit == 'g')) {
+        n <<= 30;
+        unit++;
+    }
+    *value = n;
+    return unit == end ? 0 : -1;
+}
+
+int queryDate(const char *s, time_t *t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(s, "%Y-%m-%d", &tm);
+    if (end != NULL && *end == 'T') {
+        end = strptime(end + 1, "%H:%M:%S", &tm);
+    }
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    *t = mktime(&tm);
+    return 0;
+}
+
+// Splits the terms of a query in place; returns -1 on a malformed one
+int queryParse(Query *q, char *args) {
+    memset(q, 0, sizeof(*q));
+    q->max_size = LLONG_MAX;
+    for (char *save = NULL, *term = strtok_r(args, " ", &save); term != NULL; term = strtok_r(NULL, " ", &save)) {
+        char *value = strchr(term, '=');
+        if (strcmp(term, "list") == 0) {
+            q->list = 1;
+        } else if (value == NULL) {
+            return -1;
+        } else if (strncmp(term, "size=", 5) == 0) {
+            char *dash = strchr(value + 1, '-');
+            if (dash == NULL || querySize(value + 1, dash, &q->min_size) == -1 ||
+                querySize(dash + 1, dash + strlen(dash), &q->max_size) == -1 || q->min_size > q->max_size) {
+                return -1;
+            }
+            q->active[QUERY_SIZE] = 1;
+        } else if (strncmp(term, "ext=", 4) == 0) {
+            for (char *ext_save = NULL, *ext = strtok_r(value + 1, ",", &ext_save); ext != NULL;
+                 ext = strtok_r(NULL, ",", &ext_save)) {
+                if (q->ext_count == QUERY_MAX_EXTENSIONS) {
+                    return -1;
+                }
+                q->extensions[q->ext_count++] = ext;
+            }
+            q->active[QUERY_EXT] = q->ext_count > 0;
+        } else if (strncmp(term, "after=", 6) == 0) {
+            if (queryDate(value + 1, &q->after) == -1) {
+                return -1;
+            }
+            q->active[QUERY_AFTER] = 1;
+        } else if (strncmp(term, "before=", 7) == 0) {
+            if (queryDate(value + 1, &q->before) == -1) {
+                return -1;
+            }
+            q->active[QUERY_BEFORE] = 1;
+        } else if (strncmp(term, "name=", 5) == 0 && value[1] != '\0') {
+            snprintf(q->name, sizeof(q->name), "%s", value + 1);
+            q->active[QUERY_NAME] = 1;
+        } else {
+            return -1;
+        }
+    }
+    for (int term = 0; term < QUERY_TERMS; term++) {
+        if (q->active[term]) {
+            q->order[q->count++] = term;
+        }
+    }
+    return q->count > 0 ? 0 : -1;
+}
+
+// Newer than the given second, as find -newermt tests it
+int queryNewer(const struct stat *sb, time_t t) {
+    return sb->st_mtim.tv_sec > t || (sb->st_mtim.tv_sec == t && sb->st_mtim.tv_nsec > 0);
+}
+
+int queryTest(const Query *q, int term, const char *name, const struct stat *sb) {
+    switch (term) {
+    case QUERY_NAME:
+        return fnmatch(q->name, name, 0) == 0;
+    case QUERY_EXT: {
+        size_t len = strlen(name);
+        for (int i = 0; i < q->ext_count; i++) {
+            size_t ext_len = strlen(q->extensions[i]);
+            if (len > ext_len && name[len - ext_len - 1] == '.' && strcmp(name + len - ext_len, q->extensions[i]) == 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    case QUERY_SIZE:
+        return sb->st_size >= q->min_size && sb->st_size <= q->max_size;
+    case QUERY_AFTER:
+        return queryNewer(sb, q->after);
+    default:
+        return !queryNewer(sb, q->before);
+    }
+}
+
+// Walks one directory, adding the regular files every term accepts
+void queryWalk(Query *q, const char *path, const char *home_dir, FileList *list) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char child[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) {
+            continue;
+        }
+        struct stat sb;
+        int have_stat = 0;
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            have_stat = 1;
+            type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) {
+            queryWalk(q, child, home_dir, list);
+            continue;
+        }
+        if (type != DT_REG) {
+            continue; // like find -type f, symbolic links are not followed
+        }
+        if (q->files++ % QUERY_REORDER_INTERVAL == 0) {
+            queryRank(q);
+        }
+        int match = 1;
+        for (int i = 0; i < q->count && match; i++) {
+            int term = q->order[i];
+            if (queryNeedsStat(term) && !have_stat) {
+                if (fstatat(dirfd(dir), entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                    match = 0;
+                    break;
+                }
+                have_stat = 1;
+            }
+            q->evaluated[term]++;
+            match = queryTest(q, term, entry->d_name, &sb);
+            q->passed[term] += match;
+        }
+        if (match) {
+            logDebug("matching file", " file=%s", logQuote(child));
+            if (have_stat) {
+                fileListAddStat(list, child, home_dir, &sb);
+            } else {
+                fileListAdd(list, child, home_dir);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+// Sends the matches as a listing of member names, or as records under w24bin
+void queryList(int client_socket, FileList *list) {
+    qsort(list->items, list->count, sizeof(FileEntry), fileEntryCompare);
+    if (reply_records) {
+        RecordBuffer records = {0};
+        struct stat sb;
+        for (size_t i = 0; i < list->count; i++) {
+            if (lstat(list->items[i].path, &sb) == 0) {
+                recordAppend(&records, list->items[i].member_name, &sb);
+            }
+        }
+        send_records(client_socket, &records);
+        return;
+    }
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    for (size_t i = 0; out != NULL && i < list->count; i++) {
+        fprintf(out, "%s\n", list->items[i].member_name);
+    }
+    if (out == NULL || fclose(out) != 0) {
+        send_response(client_socket, "Error listing files");
+    } else {
+        send_response(client_socket, text);
+    }
+    free(text);
+}
+
+void performw24fq(int client_socket, char *args) {
+    Query q;
+    if (queryParse(&q, args) == -1) {
+        send_response(client_socket, "Invalid w24fq format");
+        return;
+    }
+    const char *home_dir = rootDir();
+    if (home_dir == NULL) {
+        perror("getenv");
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir("./w24project", PERMISSIONS) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+
+    FileList list = {0};
+    unsigned long long scan_start = statsNow();
+    DTRACE_PROBE1(w24, scan_start, home_dir);
+    queryWalk(&q, home_dir, home_dir, &list);
+    statsRecord(STAGE_SCAN, scan_start);
+    DTRACE_PROBE2(w24, scan_end, home_dir, list.count);
+
+    // What this walk saw ranks the terms of the next query
+    char order[64] = "";
+    for (int i = 0; i < q.count; i++) {
+        int term = q.order[i];
+        snprintf(order + strlen(order), sizeof(order) - strlen(order), "%s%s", i > 0 ? "," : "",
+                 query_term_names[term]);
+        if (node_stats != NULL) {
+            __atomic_fetch_add(&node_stats->query_evaluated[term], q.evaluated[term], __ATOMIC_RELAXED);
+            __atomic_fetch_add(&node_stats->query_passed[term], q.passed[term], __ATOMIC_RELAXED);
+        }
+    }
+    logInfo("query scanned", " files=%llu matched=%zu order=%s", q.files, list.count, order);
+
+    if (q.list) {
+        queryList(client_socket, &list);
+        fileListFree(&list);
+        return;
+    }
+    if (list.count == 0) {
+        send_response(client_socket, "No file found");
+        return;
+    }
+
+    // The same terms in any order or spelling share a cache entry
+    qsort(q.extensions, q.ext_count, sizeof(char *), dirCompare);
+    char normalized_command[BUFFER_SIZE];
+    int len = snprintf(normalized_command, sizeof(normalized_command), "w24fq");
+    if (q.active[QUERY_SIZE]) {
+        len += snprintf(normalized_command + len, sizeof(normalized_command) - len, " size=%lld-%lld", q.min_size,
+                        q.max_size);
+    }
+    for (int i = 0; i < q.ext_count && len < (int)sizeof(normalized_command); i++) {
+        len += snprintf(normalized_command + len, sizeof(normalized_command) - len, "%s%s", i == 0 ? " ext=" : ",",
+                        q.extensions[i]);
+    }
+    if (q.active[QUERY_AFTER] && len < (int)sizeof(normalized_command)) {
+        len += snprintf(normalized_command + len, sizeof(normalized_command) - len, " after=%lld", (long long)q.after);
+    }
+    if (q.active[QUERY_BEFORE] && len < (int)sizeof(normalized_command)) {
+        len += snprintf(normalized_command + len, sizeof(normalized_command) - len, " before=%lld",
+                        (long long)q.before);
+    }
+    if (q.active[QUERY_NAME] && len < (int)sizeof(normalized_command)) {
+        snprintf(normalized_command + len, sizeof(normalized_command) - len, " name=%s", q.name);
+    }
+    // Send a cached archive for the same query and matches, or build one
+    int status = serveArchive(client_socket, normalized_command, &list);
+    fileListFree(&list);
+    if (status == -1) {
+        fprintf(stderr, "Error creating tar file\n");
+        send_response(client_socket, "Error creating tar file");
+    }
+}
+
+// Function to send and receive data
+void forwardAndReceive(int client_socket, const char *command) {
+    // Send command to server
+    if (send(client_socket, command, strlen(command), 0) < 0) {
+        manageerror("Error sending data to server");
+    }
+
+    if (strcmp(command, "quitc") != 0) {
+        char buffer[BUFFER_SIZE];
+        // Receive and print list of directories or file information from server
+        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
+        if (bytes_received < 0) {
+            manageerror("Error receiving data from server");
+        } else if (bytes_received == 0) {
+            logInfo("server closed the connection", "");
+            exit(EXIT_SUCCESS);
+        }
+
+        buffer[bytes_received] = '\0';
+        logDebug("received", " data=%s", logQuote(buffer));
+
+        // Check if the command is "w24fz" and create the w24project directory if it doesn't exist
+        if (strncmp(buffer, "w24fz", 5) == 0) {
+            system("mkdir -p ~/w24project");
+            logDebug("temporary tar file created", "");
+            // Move the temporary tar file to w24project directory
+            if (system("mv /tmp/w24fda_temp/temp.tar.gz ~/w24project/") == -1) {
+                manageerror("Error moving temp.tar.gz to w24project directory");
+            }
+        }
+    }
+}
+
+void performw24ft(int client_socket, char *extensions[], int ext_count) {
+   logDebug("handling w24ft", " extensions=%d", ext_count);
+   const char *w24project_path = "./w24project";
+    //Create w24project directory if it doesn't exist
+    if (mkdir(w24project_path, PERMISSIONS) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        exit(EXIT_FAILURE);
+    }
+   // Check if the number of extensions is valid
+   if (ext_count < 1 || ext_count > 3) {
+       logWarn("invalid number of extensions", " count=%d", ext_count);
+       send_response(client_socket, "Invalid number of extensions. Provide 1 to 3 extensions.");
+       return;
+   }
+   // Construct the find command to search for files matching the specified extensions
+   char find_command[BUFFER_SIZE];
+   snprintf(find_command, sizeof(find_command), "find \"%s\" -type f \\( ", rootDir());
+   for (int i = 0; i < ext_count; i++) {
+       snprintf(find_command + strlen(find_command), sizeof(find_command) - strlen(find_command), "-name \"*.%s\"", extensions[i]);
+       if (i < ext_count - 1) {
+           snprintf(find_command + strlen(find_command), sizeof(find_command) - strlen(find_command), " -o ");
+       }
+   }
+   strcat(find_command, " \\)");
+   logDebug("running find", " command=%s", logQuote(find_command));
+   // Collect the matching files
+   FileList list = {0};
+   if (fileListCollectFind(&list, find_command, rootDir()) == -1) {
+       fileListFree(&list);
+       send_response(client_socket, "Error executing find command");
+       return;
+   }
+   // Order the extensions so that permutations of the same query share a cache entry
+   qsort(extensions, ext_count, sizeof(char *), dirCompare);
+   char normalized_command[BUFFER_SIZE];
+   snprintf(normalized_command, sizeof(normalized_command), "w24ft");
+   for (int i = 0; i < ext_count; i++) {
+       snprintf(normalized_command + strlen(normalized_command), sizeof(normalized_command) - strlen(normalized_command), " %s", extensions[i]);
+   }
+   // Send a cached archive for the same query and matches, or build one
+   int ret = serveArchive(client_socket, normalized_command, &list);
+   fileListFree(&list);
+   if (ret == -1) {
+       fprintf(stderr, "Error creating tar archive\n");
+       send_response(client_socket, "Error creating tar archive");
+   } else {
+       logDebug("archive sent", "");
+   }
+}
+
+
+// Prometheus metrics. W24_METRICS=1 starts a process that answers
+// "GET /metrics" on 127.0.0.1:METRICS_PORT (W24_METRICS_PORT overrides it).
+// It only reads the shared counters, so a scrape never waits on a handler and
+// a slow scraper never holds one up.
+typedef struct {
+    char *text;
+    size_t len;
+    size_t size;
+} MetricsText;
+
+void metricsPrintf(MetricsText *m, const char *fmt, ...) {
+    va_list args;
+    while (m->text != NULL) {
+        va_start(args, fmt);
+        int n = vsnprintf(m->text + m->len, m->size - m->len, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return;
+        }
+        if ((size_t)n < m->size - m->len) {
+            m->len += n;
+            return;
+        }
+        char *grown = realloc(m->text, m->size * 2 + n);
+        if (grown == NULL) {
+            free(m->text);
+            m->text = NULL;
+            return;
+        }
+        m->text = grown;
+        m->size = m->size * 2 + n;
+    }
+}
+
+// Upper bounds of the exported latency buckets, in seconds; the finer
+// in-memory buckets are folded into them by their midpoints
+static const double metrics_bounds[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                        0.025,  0.05,    0.1,    0.25,  0.5,    1,     2.5,
+                                        5,      10,      30,     60};
+
+void metricsLatency(MetricsText *m) {
+    metricsPrintf(m, "# HELP w24_requests_total Commands handled, by command.\n# TYPE w24_requests_total counter\n");
+    for (int c = 0; c < STAT_COMMANDS; c++) {
+        metricsPrintf(m, "w24_requests_total{command=\"%s\"} %llu\n", stat_command_names[c],
+                      __atomic_load_n(&node_stats->latency[c][STAGE_TOTAL].count, __ATOMIC_RELAXED));
+    }
+    metricsPrintf(m, "# HELP w24_stage_duration_seconds Time spent per command and stage.\n"
+                     "# TYPE w24_stage_duration_seconds histogram\n");
+    for (int c = 0; c < STAT_COMMANDS; c++) {
+        for (int s = 0; s < STAT_STAGES; s++) {
+            Histogram h = node_stats->latency[c][s];
+            unsigned long long count = 0;
+            for (int b = 0; b < STATS_BUCKETS; b++) {
+                count += h.buckets[b];
+            }
+            if (count == 0) {
+                continue;
+            }
+            unsigned long long below = 0;
+            int b = 0;
+            for (size_t i = 0; i < sizeof(metrics_bounds) / sizeof(metrics_bounds[0]); i++) {
+                for (; b < STATS_BUCKETS && (statsBucketStart(b) + statsBucketStart(b + 1)) / 2.0 / 1e9 <= metrics_bounds[i]; b++) {
+                    below += h.buckets[b];
+                }
+                metricsPrintf(m, "w24_stage_duration_seconds_bucket{command=\"%s\",stage=\"%s\",le=\"%g\"} %llu\n",
+                              stat_command_names[c], stat_stage_names[s], metrics_bounds[i], below);
+            }
+            metricsPrintf(m,
+                          "w24_stage_duration_seconds_bucket{command=\"%s\",stage=\"%s\",le=\"+Inf\"} %llu\n"
+                          "w24_stage_duration_seconds_sum{command=\"%s\",stage=\"%s\"} %.9f\n"
+                          "w24_stage_duration_seconds_count{command=\"%s\",stage=\"%s\"} %llu\n",
+                          stat_command_names[c], stat_stage_names[s], count, stat_command_names[c],
+                          stat_stage_names[s], h.sum_ns / 1e9, stat_command_names[c], stat_stage_names[s], count);
+        }
+    }
+}
+
+// How often each w24fq term was tried and let a file through; their ratio orders later queries
+void metricsQuery(MetricsText *m) {
+    metricsPrintf(m, "# HELP w24_query_term_evaluated_total Files a w24fq term was tried on.\n"
+                     "# TYPE w24_query_term_evaluated_total counter\n");
+    for (int t = 0; t < QUERY_TERMS; t++) {
+        metricsPrintf(m, "w24_query_term_evaluated_total{term=\"%s\"} %llu\n", query_term_names[t],
+                      __atomic_load_n(&node_stats->query_evaluated[t], __ATOMIC_RELAXED));
+    }
+    metricsPrintf(m, "# HELP w24_query_term_passed_total Files a w24fq term let through.\n"
+                     "# TYPE w24_query_term_passed_total counter\n");
+    for (int t = 0; t < QUERY_TERMS; t++) {
+        metricsPrintf(m, "w24_query_term_passed_total{term=\"%s\"} %llu\n", query_term_names[t],
+                      __atomic_load_n(&node_stats->query_passed[t], __ATOMIC_RELAXED));
+    }
+}
+
+// Size and age of the content hash index, and size of the archive cache
+void metricsStorage(MetricsText *m) {
+    struct stat st;
+    int have_index = stat(HASH_INDEX_FILE, &st) == 0;
+    metricsPrintf(m,
+                  "# HELP w24_hash_index_bytes Size of the content hash index.\n# TYPE w24_hash_index_bytes gauge\n"
+                  "w24_hash_index_bytes %lld\n"
+                  "# HELP w24_hash_index_entries Records in the content hash index.\n"
+                  "# TYPE w24_hash_index_entries gauge\nw24_hash_index_entries %lld\n",
+                  have_index ? (long long)st.st_size : 0LL,
+                  have_index ? (long long)(st.st_size / sizeof(HashRecord)) : 0LL);
+    if (have_index) {
+        metricsPrintf(m,
+                      "# HELP w24_hash_index_age_seconds Time since a record was last added to the index.\n"
+                      "# TYPE w24_hash_index_age_seconds gauge\nw24_hash_index_age_seconds %lld\n",
+                      (long long)(time(NULL) - st.st_mtime));
+    }
+    long long cache_bytes = 0, cache_files = 0;
+    DIR *dir = opendir(CACHE_DIR);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+            cache_bytes += st.st_size;
+            cache_files++;
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+    metricsPrintf(m,
+                  "# HELP w24_archive_cache_bytes Size of the finished archives kept in the cache.\n"
+                  "# TYPE w24_archive_cache_bytes gauge\nw24_archive_cache_bytes %lld\n"
+                  "# HELP w24_archive_cache_files Archives kept in the cache.\n"
+                  "# TYPE w24_archive_cache_files gauge\nw24_archive_cache_files %lld\n",
+                  cache_bytes, cache_files);
+}
+
+// Returns the exposition text, which the caller frees, or NULL
+char *metricsRender(size_t *len) {
+    MetricsText m = {malloc(64 * 1024), 0, 64 * 1024};
+    metricsPrintf(&m,
+                  "# HELP w24_info This node.\n# TYPE w24_info gauge\nw24_info{node=\"%s\"} 1\n"
+                  "# HELP w24_start_time_seconds When the node started, in seconds since the epoch.\n"
+                  "# TYPE w24_start_time_seconds gauge\nw24_start_time_seconds %lld\n"
+                  "# HELP w24_connections_active Connections being served, one handler process each.\n"
+                  "# TYPE w24_connections_active gauge\nw24_connections_active %lld\n"
+                  "# HELP w24_connections_total Connections accepted.\n"
+                  "# TYPE w24_connections_total counter\nw24_connections_total %llu\n"
+                  "# HELP w24_forks_total Handler processes forked.\n# TYPE w24_forks_total counter\nw24_forks_total %llu\n"
+                  "# HELP w24_fork_failures_total Connections dropped because fork failed.\n"
+                  "# TYPE w24_fork_failures_total counter\nw24_fork_failures_total %llu\n"
+                  "# HELP w24_sent_bytes_total Bytes sent to clients.\n"
+                  "# TYPE w24_sent_bytes_total counter\nw24_sent_bytes_total %llu\n"
+                  "# HELP w24_archive_bytes_total Archive and delta bytes sent to clients.\n"
+                  "# TYPE w24_archive_bytes_total counter\nw24_archive_bytes_total %llu\n"
+                  "# HELP w24_log_dropped_total Log buffers dropped because the logger fell behind.\n"
+                  "# TYPE w24_log_dropped_total counter\nw24_log_dropped_total %llu\n",
+                  NODE_NAME, (long long)node_stats->started,
+                  __atomic_load_n(&node_stats->connections_active, __ATOMIC_RELAXED),
+                  __atomic_load_n(&node_stats->connections_total, __ATOMIC_RELAXED),
+                  __atomic_load_n(&node_stats->forks, __ATOMIC_RELAXED),
+                  __atomic_load_n(&node_stats->fork_failures, __ATOMIC_RELAXED),
+                  __atomic_load_n(&node_stats->bytes_sent, __ATOMIC_RELAXED),
+                  __atomic_load_n(&node_stats->archive_bytes, __ATOMIC_RELAXED),
+                  __atomic_load_n(&node_stats->log_dropped, __ATOMIC_RELAXED));
+    metricsLatency(&m);
+    metricsStorage(&m);
+    metricsQuery(&m);
+    *len = m.len;
+    return m.text;
+}
+
+// Answers one scrape; anything but GET /metrics gets a 404
+void metricsServe(int fd) {
+    char request[2048];
+    size_t used = 0;
+    while (used + 1 < sizeof(request)) {
+        ssize_t n = recv(fd, request + used, sizeof(request) - 1 - used, 0);
+        if (n <= 0) {
+            break;
+        }
+        used += n;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[used] = '\0';
+    size_t len = 0;
+    char *body = NULL;
+    if (strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET /metrics?", 13) == 0) {
+        body = metricsRender(&len);
+    }
+    char header[160];
+    int header_len = body != NULL
+                         ? snprintf(header, sizeof(header),
+                                    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                    "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                                    len)
+                         : snprintf(header, sizeof(header),
+                                    "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    if (send(fd, header, header_len, body != NULL ? MSG_MORE : 0) != -1 && body != NULL) {
+        writeAll(fd, body, len);
+    }
+    free(body);
+}
+
+// Starts the metrics process if W24_METRICS asks for it; listen_socket is the
+// node's own, which the metrics process closes
+void metricsStart(int listen_socket) {
+    const char *enabled = getenv("W24_METRICS");
+    if (enabled == NULL || enabled[0] == '\0' || strcmp(enabled, "0") == 0 || node_stats == NULL) {
+        return;
+    }
+    const char *port_env = getenv("W24_METRICS_PORT");
+    int port = port_env != NULL && atoi(port_env) > 0 ? atoi(port_env) : METRICS_PORT;
+    int metrics_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (metrics_socket == -1 ||
+        setsockopt(metrics_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+        bind(metrics_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(metrics_socket, 8) == -1) {
+        perror("metrics listener");
+        if (metrics_socket != -1) {
+            close(metrics_socket);
+        }
+        return;
+    }
+    pid_t parent = getpid();
+    logFlush();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork metrics");
+    }
+    if (pid != 0) {
+        close(metrics_socket);
+        if (pid > 0) {
+            logInfo("metrics listening", " address=127.0.0.1:%d", port);
+        }
+        return;
+    }
+    // Go when the node goes
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        exit(EXIT_SUCCESS);
+    }
+    close(listen_socket);
+    while (1) {
+        int fd = accept(metrics_socket, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+        struct timeval timeout = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        metricsServe(fd);
+        close(fd);
+    }
+}
+
+int main() {
+    int server_socket, client_socket;
+    struct sockaddr_in server_addr, client_addr;
+    socklen_t sin_size;
+ 
+    logInit();
+
+    // Create socket
+    if ((server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+ 
+    // Server address setup
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(PORT);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    memset(&(server_addr.sin_zero), '\0', 8);
+ 
+    // Bind socket
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(struct sockaddr)) == -1) {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+ 
+    // Listen for connections
+    if (listen(server_socket, 15) == -1) {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+ 
+    logInfo("listening", " port=%d", PORT);
+ 
+    // Handlers run in parallel, so reap them automatically and clear out
+    // work areas of handlers that did not exit cleanly last time
+    signal(SIGCHLD, SIG_IGN);
+    // A client disconnecting mid-send must not kill the handler before it cleans up
+    signal(SIGPIPE, SIG_IGN);
+    sweepStaleWorkAreas();
+    statsInit();
+    traceInit();
+    metricsStart(server_socket);
+ 
+    while (1) {
+        sin_size = sizeof(struct sockaddr_in);
+        if ((client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &sin_size)) == -1) {
+            perror("Accept failed");
+            continue;
+        }
+        trace_accepted = statsNow();
+        DTRACE_PROBE1(w24, accept, client_socket);
+        // Replies are corked with MSG_MORE, so Nagle would only delay the ones answering pipelined commands
+        int nodelay = 1;
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+ 
+        logInfo("connection", " from=%s", inet_ntoa(client_addr.sin_addr));
+ 
+        logFlush(); // the child must not inherit records still to be written
+        // Fork child process so that archive jobs of different clients run in parallel
+        pid_t pid = fork();
+        if (pid == 0) { // Child process
+            close(server_socket);
+            signal(SIGCHLD, SIG_DFL); // popen()/pclose() need to reap their own children
+            statsConnectionOpened();
+            manageRequest(server_socket, client_socket);
+            exit(EXIT_SUCCESS);
+        } else if (pid > 0) { // Parent process
+            close(client_socket);
+            statsForked(1);
+        } else {
+            perror("Fork failed");
+            statsForked(0);
+            close(client_socket);
+        }
+    }
+ 
+    // Close server socket
+    close(server_socket);
+ 
+    return 0;
+}
+ 
+
+
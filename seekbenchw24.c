@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#define MAX_EXTENTS 4096 // extents looked up per file
+#define READ_BUFFER_SIZE (1024 * 1024)
+
+// Compares the read orders offered by W24_READ_ORDER (name, inode, extent) on
+// a directory tree. For each order it replays the files' FIEMAP extents and
+// counts the jumps the disk head would make between them; with --read it also
+// times reading every file with the page cache dropped first.
+//
+//   seekbenchw24 <directory> [--read]
+
+typedef struct {
+    unsigned long long start;
+    unsigned long long length;
+} Extent;
+
+typedef struct {
+    char *path;
+    const char *name; // relative to the benchmarked directory
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    unsigned long long position; // first extent, or the inode when FIEMAP fails
+    Extent *extents;
+    int extent_count;
+} BenchFile;
+
+BenchFile *files;
+size_t file_count;
+size_t file_capacity;
+size_t root_len;
+int fiemap_failures;
+
+// Fills file->extents from FIEMAP; returns -1 if the filesystem cannot map it
+int loadExtents(BenchFile *file, int fd) {
+    size_t size = sizeof(struct fiemap) + MAX_EXTENTS * sizeof(struct fiemap_extent);
+    struct fiemap *map = calloc(1, size);
+    if (map == NULL) {
+        return -1;
+    }
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = MAX_EXTENTS;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == -1) {
+        free(map);
+        return -1;
+    }
+    file->extents = malloc((map->fm_mapped_extents + 1) * sizeof(Extent));
+    for (unsigned int i = 0; file->extents != NULL && i < map->fm_mapped_extents; i++) {
+        file->extents[i].start = map->fm_extents[i].fe_physical;
+        file->extents[i].length = map->fm_extents[i].fe_length;
+    }
+    file->extent_count = file->extents != NULL ? (int)map->fm_mapped_extents : 0;
+    free(map);
+    return 0;
+}
+
+int addFile(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+    if (typeflag != FTW_F || !S_ISREG(sb->st_mode)) {
+        return 0;
+    }
+    if (file_count == file_capacity) {
+        file_capacity = file_capacity ? file_capacity * 2 : 1024;
+        BenchFile *grown = realloc(files, file_capacity * sizeof(BenchFile));
+        if (grown == NULL) {
+            return 1;
+        }
+        files = grown;
+    }
+    BenchFile *file = &files[file_count];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(fpath);
+    if (file->path == NULL) {
+        return 1;
+    }
+    file->name = file->path + root_len + 1;
+    file->dev = sb->st_dev;
+    file->ino = sb->st_ino;
+    file->size = sb->st_size;
+    file->position = sb->st_ino;
+    int fd = open(fpath, O_RDONLY);
+    if (fd != -1 && loadExtents(file, fd) == 0) {
+        file->position = file->extent_count > 0 ? file->extents[0].start : 0;
+    } else {
+        fiemap_failures++;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    file_count++;
+    return 0;
+}
+
+// The three orders, as serverw24 applies them
+int nameCompare(const void *a, const void *b) {
+    return strcmp(((const BenchFile *)a)->name, ((const BenchFile *)b)->name);
+}
+
+int inodeCompare(const void *a, const void *b) {
+    const BenchFile *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return x->ino < y->ino ? -1 : x->ino > y->ino ? 1 : nameCompare(a, b);
+}
+
+int extentCompare(const void *a, const void *b) {
+    const BenchFile *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    return x->position < y->position ? -1 : x->position > y->position ? 1 : nameCompare(a, b);
+}
+
+// Counts discontiguous jumps between consecutive extents and their total distance
+void replaySeeks(long long *seeks, double *distance) {
+    unsigned long long head = 0;
+    int started = 0;
+    *seeks = 0;
+    *distance = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        for (int e = 0; e < files[i].extent_count; e++) {
+            const Extent *extent = &files[i].extents[e];
+            if (started && extent->start != head) {
+                (*seeks)++;
+                *distance += extent->start > head ? extent->start - head : head - extent->start;
+            }
+            head = extent->start + extent->length;
+            started = 1;
+        }
+    }
+}
+
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads every file in the current order from a cold page cache; returns seconds
+double timedRead(char *buffer) {
+    for (size_t i = 0; i < file_count; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd != -1) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    double start = now();
+    for (size_t i = 0; i < file_count; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd == -1) {
+            continue;
+        }
+        while (read(fd, buffer, READ_BUFFER_SIZE) > 0) {
+        }
+        close(fd);
+    }
+    return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <directory> [--read]\n", argv[0]);
+        return 1;
+    }
+    int timed = argc > 2 && strcmp(argv[2], "--read") == 0;
+    char root[PATH_MAX];
+    if (realpath(argv[1], root) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    root_len = strlen(root);
+    if (nftw(root, addFile, 64, FTW_PHYS) != 0) {
+        perror("nftw");
+        return 1;
+    }
+    long long total_bytes = 0;
+    for (size_t i = 0; i < file_count; i++) {
+        total_bytes += files[i].size;
+    }
+    printf("%zu files, %lld bytes under %s", file_count, total_bytes, root);
+    if (fiemap_failures > 0) {
+        printf(" (%d without extent data)", fiemap_failures);
+    }
+    printf("\n\n%-8s %12s %18s", "order", "seeks", "seek distance MiB");
+    if (timed) {
+        printf(" %12s %10s", "read s", "MB/s");
+    }
+    printf("\n");
+
+    char *buffer = timed ? malloc(READ_BUFFER_SIZE) : NULL;
+    const char *names[] = {"name", "inode", "extent"};
+    int (*orders[])(const void *, const void *) = {nameCompare, inodeCompare, extentCompare};
+    long long baseline_seeks = 0;
+    for (int o = 0; o < 3; o++) {
+        qsort(files, file_count, sizeof(BenchFile), orders[o]);
+        long long seeks;
+        double distance;
+        replaySeeks(&seeks, &distance);
+        if (o == 0) {
+            baseline_seeks = seeks;
+        }
+        printf("%-8s %12lld %18.1f", names[o], seeks, distance / (1024 * 1024));
+        if (buffer != NULL) {
+            double seconds = timedRead(buffer);
+            printf(" %12.3f %10.1f", seconds, seconds > 0 ? total_bytes / seconds / (1024 * 1024) : 0.0);
+        }
+        if (o > 0 && baseline_seeks > 0) {
+            printf("   %.0f%% of name-order seeks", 100.0 * seeks / baseline_seeks);
+        }
+        printf("\n");
+    }
+    free(buffer);
+    for (size_t i = 0; i < file_count; i++) {
+        free(files[i].path);
+        free(files[i].extents);
+    }
+    free(files);
+    return 0;
+}